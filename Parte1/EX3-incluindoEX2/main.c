@@ -21,7 +21,7 @@ int max_backups=0;
 int activeBackups=0;
 
 void *process_job_file(void *arg);
-void execute_command(enum Command cmd, int fd ,int *backupCounter,char inputFileName[],int output_fd);
+void execute_command(enum Command cmd, int fd ,int *backupCounter,char inputFileName[],int output_fd,char keys[][MAX_STRING_SIZE],char values[][MAX_STRING_SIZE]);
 
 
 int main(int argc, char *argv[]) {
@@ -122,20 +122,22 @@ void *process_job_file(void *arg ) {
   }
   
   fflush(stdout);
+  // Reutilizados por todos os comandos da thread; o parser termina cada
+  // string, por isso não precisam de ser limpos entre comandos
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
   while (1) {
     enum Command cmd = get_next(input_fd);
     if (cmd == EOC) break;
     // Executar cada comando
-    execute_command(cmd, input_fd,backupCounter,dp->d_name,output_fd);
+    execute_command(cmd, input_fd,backupCounter,dp->d_name,output_fd,keys,values);
   }
   close(input_fd);
   close(output_fd);
   pthread_exit(NULL);
 }
 
-void execute_command(enum Command cmd, int fd ,int *backupCounter,char inputFileName[],int output_fd) {
-  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
+void execute_command(enum Command cmd, int fd ,int *backupCounter,char inputFileName[],int output_fd,char keys[][MAX_STRING_SIZE],char values[][MAX_STRING_SIZE]) {
   unsigned int delay;
   size_t num_pairs;
 
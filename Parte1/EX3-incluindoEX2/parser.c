@@ -40,6 +40,10 @@ static int read_string(int fd, char *buffer, size_t max) {
     buffer[i++] = ch;
   }
 
+  if (i == max) {
+    // no room left for the terminator
+    return -1;
+  }
   buffer[i] = '\0';
 
   return value;
@@ -168,13 +172,13 @@ enum Command get_next(int fd) {
   }
 }
 
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
+int parse_pair(int fd, char *key, char *value, size_t max_string_size) {
+  if (read_string(fd, key, max_string_size) != 0) {
     cleanup(fd);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
+  if (read_string(fd, value, max_string_size) != 1) {
     cleanup(fd);
     return 0;
   }
@@ -196,16 +200,12 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
   }
 
   size_t num_pairs = 0;
-  char key[max_string_size];
-  char value[max_string_size];
   while (num_pairs < max_pairs) {
-    if(parse_pair(fd, key, value) == 0) {
+    if(parse_pair(fd, keys[num_pairs], values[num_pairs], max_string_size) == 0) {
       cleanup(fd);
       return 0;
     }
-
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
+    num_pairs++;
 
     if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
       cleanup(fd);
@@ -239,15 +239,13 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   }
 
   size_t num_keys = 0;
-  char key[max_string_size];
   while (num_keys < max_keys) {
-    int output = read_string(fd, key, max_string_size);
+    int output = read_string(fd, keys[num_keys], max_string_size);
     if(output < 0 || output == 1) {
       cleanup(fd);
       return 0;
     }
-
-    strcpy(keys[num_keys++], key);
+    num_keys++;
 
     if (output == 2){
       break;
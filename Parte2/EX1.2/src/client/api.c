@@ -3,52 +3,498 @@
 #include "../common/constants.h"
 #include "../common/protocol.h"
 #include "../common/io.h"
+#include "../common/ring.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+// How often a client waiting on shared memory for a response checks that the
+// server is still there
+#define CHANNEL_CHECK_MS 1000
+
+// Shared memory carrying the requests and responses of the session, NULL if
+// its pipes carry them (see SHM_TRANSPORT)
+static shm_channel_t *channel = NULL;
+
+// Socket carrying the requests, responses and notifications of the session,
+// -1 if its pipes carry them (see SOCKET_TRANSPORT)
+static int session_socket = -1;
+// Reads the socket while no response is awaited and keys are subscribed,
+// printing the notifications
+static pthread_t socket_reader;
+// Requests not sent yet, sent at once before waiting for a response
+static message_batch_t outbox;
+// Messages received on the socket and not popped yet, by whichever thread
+// reads it: the one awaiting a response, or else socket_reader
+static message_batch_t inbox;
+static pthread_mutex_t inbox_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a response socket_reader waits on is popped, or a key is
+// subscribed
+static pthread_cond_t inbox_changed = PTHREAD_COND_INITIALIZER;
+// Whether socket_reader waits for the response first in inbox to be popped
+static int reader_waiting = 0;
+// Keys subscribed, no notifications coming while there are none. Then
+// socket_reader does not wait on the socket, where it would be woken up by
+// every response too
+static size_t num_subscribed = 0;
+
+// Id of the next request of the session, echoed in its response
+static uint32_t next_request_id = 1;
+// Result of the last response read
+static uint8_t last_result = 0;
+
+// A logical channel opened by kvs_open_channel.
+typedef struct {
+  kvs_notify_fn on_notify; // NULL if not open
+  void *arg;
+} channel_handler_t;
+
+// The logical channels of the session, by id. 0, that of kvs_subscribe, is
+// never opened: its notifications are printed
+static channel_handler_t channels[MAX_CHANNELS];
+// Held to open or close a channel, and to call its handler, so that none is
+// called once kvs_close_channel returns
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A request whose response was not read yet.
+typedef struct {
+  uint8_t opcode;
+  uint32_t request_id;
+  const char *operation; // name, for the output, NULL to print nothing
+} pending_t;
+
+// Requests sent and not answered yet, oldest first, in a ring
+static pending_t pending[MAX_PIPELINED_REQUESTS];
+static size_t first_pending = 0;
+static size_t num_pending = 0;
+// Most requests left unanswered by kvs_write, kvs_read and kvs_delete
+static size_t max_pending = 0;
+
+// Whether the server closed a pipe of the session, ending it.
+static int server_closed(int resp_pipe) {
+  struct pollfd pfd = {resp_pipe, POLLIN, 0};
+  return poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLHUP | POLLERR));
+}
+
+// Prints a notification: the key and its value, each ended by '\0'. Those of
+// a channel opened by kvs_open_channel are handed to its handler instead, and
+// those of one closed dropped.
+// @return 1 if the key was deleted, which unsubscribes it, 0 otherwise.
+static int print_notification(const message_header_t *header,
+                              const char *payload) {
+  if (header->payload_size == 0 || payload[header->payload_size - 1] != '\0') {
+    return 0;
+  }
+  const char *value = payload + strlen(payload) + 1;
+  if (header->channel == 0) {
+    printf("(%s,%s)\n", payload, value);
+  } else if (header->channel < MAX_CHANNELS) {
+    pthread_mutex_lock(&channels_lock);
+    const channel_handler_t *handler = &channels[header->channel];
+    if (handler->on_notify != NULL) {
+      handler->on_notify(header->channel, payload, value, handler->arg);
+    }
+    pthread_mutex_unlock(&channels_lock);
+  }
+  return strcmp(value, "DELETED") == 0;
+}
+
+// Reads a response from the socket of the session, printing the
+// notifications that came before it.
+// @return As receive_message.
+static int receive_socket(message_header_t *response, char *output) {
+  pthread_mutex_lock(&inbox_lock);
+  int received;
+  while (1) {
+    received = batch_pop(&inbox, response, output, MAX_PAYLOAD_SIZE);
+    if (received == 0) {
+      received = receive_batch(&inbox, session_socket, 1);
+      if (received <= 0) {
+        break;
+      }
+    } else if (response->opcode != OP_CODE_NOTIFY) {
+      break;
+    } else if (received == 1 && print_notification(response, output) &&
+               num_subscribed > 0) {
+      num_subscribed--;
+    }
+  }
+  // Subscribed or unsubscribed by the server
+  if (received == 1 && response->result == 1 &&
+      (response->opcode == OP_CODE_SUBSCRIBE ||
+       response->opcode == OP_CODE_UNSUBSCRIBE)) {
+    if (response->opcode == OP_CODE_SUBSCRIBE) {
+      num_subscribed++;
+      // socket_reader waits on the socket from the first one on
+      if (num_subscribed == 1) {
+        pthread_cond_signal(&inbox_changed);
+      }
+    } else if (num_subscribed > 0) {
+      num_subscribed--;
+    }
+  }
+  // Its result is how many keys the channel had
+  if (received == 1 && response->opcode == OP_CODE_CLOSE_CHANNEL) {
+    num_subscribed -= response->result < num_subscribed ? response->result
+                                                        : num_subscribed;
+  }
+  if (reader_waiting) {
+    pthread_cond_signal(&inbox_changed);
+  }
+  pthread_mutex_unlock(&inbox_lock);
+  return received;
+}
+
+// Prints the notifications that come on the socket of the session while no
+// response is awaited, until it is closed.
+// @param arg The socket.
+static void *socket_thread(void *arg) {
+  struct pollfd pfd = {(int)(intptr_t)arg, POLLIN, 0};
+  message_header_t header;
+  char payload[MAX_PAYLOAD_SIZE];
+  pthread_mutex_lock(&inbox_lock);
+  while (1) {
+    if (batch_peek(&inbox, &header)) {
+      // A response is left for receive_socket, and what follows it too
+      if (header.opcode != OP_CODE_NOTIFY) {
+        if (session_socket < 0) {
+          break;
+        }
+        reader_waiting = 1;
+        pthread_cond_wait(&inbox_changed, &inbox_lock);
+        reader_waiting = 0;
+      } else if (batch_pop(&inbox, &header, payload, sizeof(payload)) == 1 &&
+                 print_notification(&header, payload) &&
+                 num_subscribed > 0) {
+        num_subscribed--;
+      }
+      continue;
+    }
+    if (num_subscribed == 0) {
+      if (session_socket < 0) {
+        break;
+      }
+      pthread_cond_wait(&inbox_changed, &inbox_lock);
+      continue;
+    }
+    pthread_mutex_unlock(&inbox_lock);
+    int ready = poll(&pfd, 1, -1);
+    pthread_mutex_lock(&inbox_lock);
+    if (ready < 0 && errno != EINTR) {
+      break;
+    }
+    // Read meanwhile by receive_socket, maybe
+    int received = receive_batch(&inbox, pfd.fd, 0);
+    if (received == 0 || (received < 0 && errno != EAGAIN)) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&inbox_lock);
+  return NULL;
+}
+
+// Reads a response, from the response pipe, the socket or the shared memory.
+// @return As receive_message.
+static int receive_reply(int resp_pipe, message_header_t *response,
+                         char *output) {
+  if (session_socket >= 0) {
+    // The requests gathered are all sent before waiting
+    if (send_batch(&outbox, session_socket) < 0) {
+      return -1;
+    }
+    return receive_socket(response, output);
+  }
+  if (channel == NULL) {
+    return receive_message(resp_pipe, response, output, MAX_PAYLOAD_SIZE,
+                           NULL);
+  }
+  while (1) {
+    int received = ring_pop(&channel->responses, response, output,
+                            MAX_PAYLOAD_SIZE);
+    if (received != 0) {
+      return received;
+    }
+    if (!ring_wait(&channel->responses, CHANNEL_CHECK_MS) &&
+        server_closed(resp_pipe)) {
+      return 0;
+    }
+  }
+}
+
+// Reads the response to the oldest request sent, printing its result and
+// output.
+// @return 0 if the server replied, 1 if it is gone (EOF or EPIPE) or the
+// reply is not to that request.
+static int receive_response(int resp_pipe) {
+  const pending_t *oldest = &pending[first_pending];
+  message_header_t response;
+  char output[MAX_PAYLOAD_SIZE + 1];
+  if (receive_reply(resp_pipe, &response, output) != 1 ||
+      response.opcode != oldest->opcode ||
+      response.request_id != oldest->request_id) {
+    return 1;
+  }
+  first_pending = (first_pending + 1) % MAX_PIPELINED_REQUESTS;
+  num_pending--;
+  last_result = response.result;
+
+  if (oldest->operation == NULL) {
+    return 0;
+  }
+  printf("Server returned %d for operation: %s\n", response.result,
+         oldest->operation);
+  if (response.payload_size > 0) {
+    output[response.payload_size] = '\0';
+    printf("%s", output);
+  }
+  return 0;
+}
+
+// Sends a request, first reading responses if MAX_PIPELINED_REQUESTS are
+// unanswered.
+// @param channel_id Logical channel of the request, 0 but for subscriptions.
+// @param opcode Opcode of the request.
+// @param payload Payload of the request.
+// @param size Size of the payload.
+// @param operation Name of the operation, for the output.
+// @return 0 if sent, 1 if the server is gone.
+static int send_request(int req_pipe, int resp_pipe, uint16_t channel_id,
+                        uint8_t opcode, const void *payload, size_t size,
+                        const char *operation) {
+  if (num_pending == MAX_PIPELINED_REQUESTS && receive_response(resp_pipe)) {
+    return 1;
+  }
+  message_header_t header = {opcode, 0, channel_id, next_request_id++,
+                             (uint32_t)size};
+  if (channel != NULL) {
+    // Never full, with at most MAX_PIPELINED_REQUESTS unanswered. A byte on
+    // the request pipe wakes the server up, if it went idle
+    if (!ring_push(&channel->requests, &header, payload) ||
+        (ring_wake_needed(&channel->requests) && write(req_pipe, "", 1) != 1)) {
+      return 1;
+    }
+  } else if (session_socket >= 0) {
+    // Sent with the next ones, at once, unless there are more than fit
+    if (batch_add(&outbox, req_pipe, &header, payload) < 0) {
+      return 1;
+    }
+  } else if (send_message(req_pipe, &header, payload) < 0) {
+    return 1;
+  }
+  pending[(first_pending + num_pending) % MAX_PIPELINED_REQUESTS] =
+      (pending_t){opcode, header.request_id, operation};
+  num_pending++;
+  return 0;
+}
+
+// Sends a request and waits for its response, and those of the ones before.
+// @return 0 if the server replied, 1 if it is gone.
+static int request(int req_pipe, int resp_pipe, uint16_t channel_id,
+                   uint8_t opcode, const void *payload, size_t size,
+                   const char *operation) {
+  return send_request(req_pipe, resp_pipe, channel_id, opcode, payload, size,
+                      operation) ||
+         kvs_flush(resp_pipe);
+}
+
+// Sends a WRITE, READ or DELETE, leaving at most max_pending unanswered.
+// @param strings The keys, or keys and values, to send, each ended by '\0'.
+// @return 0 if sent, 1 if the server is gone or there are too many strings.
+static int data_request(int req_pipe, int resp_pipe, uint8_t opcode,
+                        size_t num_strings, const char *strings[],
+                        const char *operation) {
+  char payload[MAX_PAYLOAD_SIZE];
+  size_t size = 0;
+  for (size_t i = 0; i < num_strings; i++) {
+    size_t len = strnlen(strings[i], MAX_STRING_SIZE - 1);
+    if (size + len + 1 > sizeof(payload)) {
+      fprintf(stderr, "Too many keys for operation: %s\n", operation);
+      return 1;
+    }
+    memcpy(payload + size, strings[i], len);
+    payload[size + len] = '\0';
+    size += len + 1;
+  }
+
+  if (send_request(req_pipe, resp_pipe, 0, opcode, payload, size,
+                   operation)) {
+    return 1;
+  }
+  while (num_pending > max_pending) {
+    if (receive_response(resp_pipe)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Creates the shared memory offered to the server at connect.
+// @param name Name to create it with.
+// @return The memory, mapped, NULL if it could not be created.
+static shm_channel_t *create_channel(const char *name) {
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    return NULL;
+  }
+  shm_channel_t *mem = NULL;
+  if (ftruncate(fd, sizeof(shm_channel_t)) == 0) {
+    mem = mmap(NULL, sizeof(shm_channel_t), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+      mem = NULL;
+    }
+  }
+  close(fd);
+  if (mem == NULL) {
+    shm_unlink(name);
+    return NULL;
+  }
+  mem->magic = SHM_CHANNEL_MAGIC;
+  mem->size = sizeof(shm_channel_t);
+  ring_init(&mem->requests, 1); // the server waits for the first one
+  ring_init(&mem->responses, 0);
+  return mem;
+}
+
+// Unmaps the shared memory of the session, if any.
+// @param name Its name, to remove it too, NULL if already removed.
+static void drop_channel(const char *name) {
+  if (channel == NULL) {
+    return;
+  }
+  munmap(channel, sizeof(shm_channel_t));
+  channel = NULL;
+  if (name != NULL) {
+    shm_unlink(name);
+  }
+}
+
+// Connects through the socket of the server, beside its register pipe,
+// which then carries the requests, responses and notifications of the
+// session (see SOCKET_TRANSPORT).
+// @return As kvs_connect.
+static int connect_socket(const char *server_pipe_path, int *req_pipe,
+                          int *resp_pipe) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(server_pipe_path) + sizeof(".sock") > sizeof(addr.sun_path)) {
+    fprintf(stderr, "Pipe path too long: %s\n", server_pipe_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, server_pipe_path);
+  strcat(addr.sun_path, ".sock");
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return 1;
+  }
+  set_socket_buffers(fd);
+  message_header_t response;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      receive_message(fd, &response, NULL, 0, NULL) != 1 ||
+      response.opcode != OP_CODE_CONNECT) {
+    close(fd);
+    return 1;
+  }
+  printf("Server returned %d for operation: connect\n", response.result);
+  if (response.result != 0 || (*resp_pipe = dup(fd)) < 0) {
+    close(fd);
+    return 1;
+  }
+  *req_pipe = fd;
+
+  session_socket = fd;
+  num_subscribed = 0;
+  batch_init(&outbox, 1);
+  batch_init(&inbox, 1);
+  if (pthread_create(&socket_reader, NULL, socket_thread,
+                     (void *)(intptr_t)fd)) {
+    perror("pthread_create failed");
+  }
+  return 0;
+}
+
 int kvs_connect(char const *req_pipe_path, char const *resp_pipe_path,
-                char const *server_pipe_path, char const *notif_pipe_path) {
+                char const *server_pipe_path, char const *notif_pipe_path,
+                int *req_pipe, int *resp_pipe) {
+  if (SOCKET_TRANSPORT) {
+    return connect_socket(server_pipe_path, req_pipe, resp_pipe);
+  }
   // create pipes and connect
-  char message[121];
-  message[0]='1';
-  pad_string(message + 1, req_pipe_path);
-  pad_string(message + 1 + 40, resp_pipe_path);
-  pad_string(message + 1 + 2 * 40, notif_pipe_path);
-  
+  // The paths, and the name of the shared memory offered, each ended by '\0'
+  char shm_name[MAX_PIPE_PATH_LENGTH];
+  snprintf(shm_name, sizeof(shm_name), "/kvs-%d", (int)getpid());
+  if (SHM_TRANSPORT) {
+    channel = create_channel(shm_name);
+  }
+  char payload[4 * MAX_PIPE_PATH_LENGTH];
+  size_t size = 0;
+  const char *paths[4] = {req_pipe_path, resp_pipe_path, notif_pipe_path,
+                          shm_name};
+  for (int i = 0; i < (channel != NULL ? 4 : 3); i++) {
+    size_t len = strlen(paths[i]);
+    if (len >= MAX_PIPE_PATH_LENGTH) {
+      fprintf(stderr, "Pipe path too long: %s\n", paths[i]);
+      drop_channel(shm_name);
+      return 1;
+    }
+    memcpy(payload + size, paths[i], len + 1);
+    size += len + 1;
+  }
+  message_header_t header = {OP_CODE_CONNECT, 0, 0, 0, (uint32_t)size};
+
   int server_fd=open(server_pipe_path, O_WRONLY);
-  
-  ssize_t bytes_written = write(server_fd, message, 121);
-  if(bytes_written<0){
+  if (server_fd < 0 || send_message(server_fd, &header, payload) < 0) {
     close(server_fd);
-    pthread_exit(NULL);
+    drop_channel(shm_name);
     return 1;
   }
-  if (bytes_written != 121) {
-    perror("write");
+  close(server_fd);
+
+  // Opened in the order the server opens them, and kept open until the
+  // disconnect. Read only, so that the server closing them is an EOF
+  *resp_pipe = open(resp_pipe_path, O_RDONLY);
+  message_header_t response;
+  // Whether the server uses the shared memory offered
+  uint8_t uses_channel = 0;
+  if (*resp_pipe < 0 ||
+      receive_message(*resp_pipe, &response, &uses_channel,
+                      sizeof(uses_channel), NULL) != 1 ||
+      response.opcode != OP_CODE_CONNECT) {
+    close(*resp_pipe);
+    drop_channel(shm_name);
     return 1;
   }
-  int resp_pipe=open(resp_pipe_path,O_RDWR);
-
-  char buf[2];
-  ssize_t num_read = read(resp_pipe, buf, 2);
-  if (num_read > 0){
-    //printf("%c\n",buf[0]);
-    if(buf[0]=='1'){
-      if(buf[1]=='1'){
-        printf("Server returned 1 for operation: connect\n");
-        return 1;
-      }
-      else{
-        printf("Server returned 0 for operation: connect\n");
-      }
+  // Mapped by the server by now, if at all
+  if (channel != NULL) {
+    shm_unlink(shm_name);
+    if (!uses_channel) {
+      drop_channel(NULL);
     }
   }
+  printf("Server returned %d for operation: connect\n", response.result);
+  if (response.result != 0) {
+    close(*resp_pipe);
+    drop_channel(NULL);
+    return 1;
+  }
 
-  int noti_pipe=open(notif_pipe_path,O_RDWR);
+  int noti_pipe=open(notif_pipe_path,O_RDONLY);
+  *req_pipe = open(req_pipe_path, O_WRONLY);
+  if (noti_pipe < 0 || *req_pipe < 0) {
+    close(noti_pipe);
+    close(*req_pipe);
+    close(*resp_pipe);
+    drop_channel(NULL);
+    return 1;
+  }
 
   pthread_t thread;
   //GERIR O PIPE DE NOTIFICAÇÕES
@@ -60,109 +506,131 @@ int kvs_connect(char const *req_pipe_path, char const *resp_pipe_path,
 
 int kvs_disconnect(int req_pipe,int resp_pipe) {
   // close pipes and unlink pipe files
-  char message[1]="2";
-  ssize_t bytes_written =write(req_pipe,message,1);
-  if(bytes_written<0){
-    close(req_pipe);
-    close(resp_pipe);
-    pthread_exit(NULL);
-    return 1;
+  int result = request(req_pipe, resp_pipe, 0, OP_CODE_DISCONNECT, NULL, 0,
+                       "disconnect");
+  drop_channel(NULL);
+  if (session_socket >= 0) {
+    // Ends socket_thread, even if the server did not close it
+    shutdown(session_socket, SHUT_RDWR);
+    pthread_mutex_lock(&inbox_lock);
+    session_socket = -1;
+    pthread_cond_signal(&inbox_changed);
+    pthread_mutex_unlock(&inbox_lock);
+    pthread_join(socket_reader, NULL);
   }
+  return result;
+}
 
-  while(1){
-    char buf[2];
-    ssize_t num_read = read(resp_pipe, buf, 2);
-    
-    if (num_read > 0){
-      //printf("%c\n",buf[0]);
-      if(buf[0]=='2'){
-        if(buf[1]=='0')
-          printf("Server returned 0 for operation: disconnect\n");
-        else
-          printf("Server returned 1 for operation: disconnect\n");
-      }
+int kvs_subscribe(const char *key,int req_pipe,int resp_pipe) {
+  // send subscribe message to request pipe and wait for response in response
+  return request(req_pipe, resp_pipe, 0, OP_CODE_SUBSCRIBE, key,
+                 strnlen(key, MAX_STRING_SIZE), "subscribe");
+}
+
+int kvs_unsubscribe(const char *key,int req_pipe,int resp_pipe) {
+  return request(req_pipe, resp_pipe, 0, OP_CODE_UNSUBSCRIBE, key,
+                 strnlen(key, MAX_STRING_SIZE), "unsubscribe");
+}
+
+int kvs_open_channel(kvs_notify_fn on_notify, void *arg) {
+  int opened = -1;
+  pthread_mutex_lock(&channels_lock);
+  for (int i = 1; i < MAX_CHANNELS && on_notify != NULL; i++) {
+    if (channels[i].on_notify == NULL) {
+      channels[i] = (channel_handler_t){on_notify, arg};
+      opened = i;
       break;
     }
   }
-  return 0;
+  pthread_mutex_unlock(&channels_lock);
+  return opened;
 }
 
-int kvs_subscribe(const char *key,int req_pipe,int resp_pipe) {
-  // send subscribe message to request pipe and wait for response in response
-  char message[42];
-  message[0]='3';
-  size_t len = strlen(key);
-  if (len >= 40) {
-    memcpy(message+1, key, 41); 
-  } else {
-    
-    memcpy(message+1, key, len);
-    memset(message+1 + len, '\0', 41 - len);
-  }
-  ssize_t bytes_written = write(req_pipe, message, 42);
-  if(bytes_written<0){
-    close(req_pipe);
-    close(resp_pipe);
-    pthread_exit(NULL);
-    return 1;
+int kvs_channel_subscribe(int channel_id, const char *key, int req_pipe,
+                          int resp_pipe) {
+  if (channel_id <= 0 || channel_id >= MAX_CHANNELS) {
+    return 0;
+  }
+  if (request(req_pipe, resp_pipe, (uint16_t)channel_id, OP_CODE_SUBSCRIBE, key,
+              strnlen(key, MAX_STRING_SIZE), NULL)) {
+    return -1;
+  }
+  return last_result;
+}
+
+int kvs_channel_unsubscribe(int channel_id, const char *key, int req_pipe,
+                            int resp_pipe) {
+  if (channel_id <= 0 || channel_id >= MAX_CHANNELS) {
+    return 0;
+  }
+  if (request(req_pipe, resp_pipe, (uint16_t)channel_id, OP_CODE_UNSUBSCRIBE,
+              key, strnlen(key, MAX_STRING_SIZE), NULL)) {
+    return -1;
+  }
+  return last_result;
+}
+
+int kvs_close_channel(int channel_id, int req_pipe, int resp_pipe) {
+  if (channel_id <= 0 || channel_id >= MAX_CHANNELS) {
+    return 0;
   }
-  if (bytes_written != 42) {
-    perror("write");
+  int result = request(req_pipe, resp_pipe, (uint16_t)channel_id,
+                       OP_CODE_CLOSE_CHANNEL, NULL, 0, NULL);
+  pthread_mutex_lock(&channels_lock);
+  channels[channel_id] = (channel_handler_t){NULL, NULL};
+  pthread_mutex_unlock(&channels_lock);
+  return result;
+}
+
+int kvs_write(size_t num_pairs, const char *keys[], const char *values[],
+              int req_pipe, int resp_pipe) {
+  const char *strings[2 * MAX_REQUEST_PAIRS];
+  if (num_pairs > MAX_REQUEST_PAIRS) {
+    fprintf(stderr, "Too many keys for operation: write\n");
     return 1;
   }
-  
-  
-  while(1){
-    char buf[2];
-    ssize_t num_read = read(resp_pipe, buf, 2);
-    
-    if (num_read > 0){
-      if(buf[0]=='3'){
-        if(buf[1]=='0')
-          printf("Server returned 0 for operation: subscribe\n");
-        else
-          printf("Server returned 1 for operation: subscribe\n");
-      }
-      break;
-    }
+  for (size_t i = 0; i < num_pairs; i++) {
+    strings[2 * i] = keys[i];
+    strings[2 * i + 1] = values[i];
   }
-  return 0;
+  return data_request(req_pipe, resp_pipe, OP_CODE_WRITE, 2 * num_pairs,
+                      strings, "write");
 }
 
-int kvs_unsubscribe(const char *key,int req_pipe,int resp_pipe) {
-  char message[42];
-  message[0]='4';
-  size_t len = strlen(key);
-  if (len >= 40) {
-    memcpy(message+1, key, 41); 
-  } else {
-    memcpy(message+1, key, len);
-    memset(message+1 + len, '\0', 41 - len);
-  }
-  ssize_t bytes_written = write(req_pipe, message, 42);
-  if(bytes_written<0){
-    close(req_pipe);
-    close(resp_pipe);
-    pthread_exit(NULL);
+int kvs_read(size_t num_keys, const char *keys[], int req_pipe,
+             int resp_pipe) {
+  if (num_keys > MAX_REQUEST_PAIRS) {
+    fprintf(stderr, "Too many keys for operation: read\n");
     return 1;
   }
-  if (bytes_written != 42) {
-    perror("write");
+  return data_request(req_pipe, resp_pipe, OP_CODE_READ, num_keys, keys,
+                      "read");
+}
+
+int kvs_delete(size_t num_keys, const char *keys[], int req_pipe,
+               int resp_pipe) {
+  if (num_keys > MAX_REQUEST_PAIRS) {
+    fprintf(stderr, "Too many keys for operation: delete\n");
     return 1;
   }
+  return data_request(req_pipe, resp_pipe, OP_CODE_DELETE, num_keys, keys,
+                      "delete");
+}
 
-  while(1){
-    char buf[2];
-    ssize_t num_read = read(resp_pipe, buf, 2);
-    
-    if (num_read > 0){
-      if(buf[0]=='4'){
-        if(buf[1]=='0')
-          printf("Server returned 0 for operation: unsubscribe\n");
-        else
-          printf("Server returned 1 for operation: unsubscribe\n");
-      }
-      break;
+int kvs_heartbeat(int req_pipe, int resp_pipe) {
+  return request(req_pipe, resp_pipe, 0, OP_CODE_HEARTBEAT, NULL, 0, NULL);
+}
+
+void kvs_pipeline(size_t max_requests) {
+  max_pending = max_requests < MAX_PIPELINED_REQUESTS
+                    ? max_requests
+                    : MAX_PIPELINED_REQUESTS;
+}
+
+int kvs_flush(int resp_pipe) {
+  while (num_pending > 0) {
+    if (receive_response(resp_pipe)) {
+      return 1;
     }
   }
   return 0;
@@ -170,16 +638,19 @@ int kvs_unsubscribe(const char *key,int req_pipe,int resp_pipe) {
 
 void *notiThread(void *arg){
   int noti_pipe= (int)(intptr_t)arg;
-  char buf[256];
+  message_header_t header;
+  char payload[2 * MAX_STRING_SIZE + 2];
   while(1){
-    ssize_t num_read = read(noti_pipe,buf,256);
-    if(num_read<0){
+    int received = receive_message(noti_pipe, &header, payload,
+                                   sizeof(payload), NULL);
+    // EOF once the server ends the session
+    if(received == 0 || received == -1){
       close(noti_pipe);
       pthread_exit(NULL);
       return (void *)1;
     }
-    if(num_read > 0){
-      printf("%s\n",buf);
+    if (received == 1 && header.opcode == OP_CODE_NOTIFY) {
+      print_notification(&header, payload);
     }
   }
 }
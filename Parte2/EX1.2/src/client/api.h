@@ -9,27 +9,111 @@
 /// @param req_pipe_path Path to the name pipe to be created for requests.
 /// @param resp_pipe_path Path to the name pipe to be created for responses.
 /// @param server_pipe_path Path to the name pipe where the server is listening.
+/// @param req_pipe Where to store the request pipe, open for the session.
+/// @param resp_pipe Where to store the response pipe, open for the session.
+/// With SHM_TRANSPORT, shared memory is offered to the server to carry the
+/// requests and responses instead, and used if it accepts.
+/// With SOCKET_TRANSPORT, the pipes are not used: the session connects to
+/// the socket of the server, server_pipe_path followed by ".sock", and both
+/// req_pipe and resp_pipe are that connection.
 /// @return 0 if the connection was established successfully, 1 otherwise.
 int kvs_connect(char const *req_pipe_path, char const *resp_pipe_path,
-                char const *server_pipe_path, char const *notif_pipe_path);
+                char const *server_pipe_path, char const *notif_pipe_path,
+                int *req_pipe, int *resp_pipe);
 /// Disconnects from an KVS server.
-/// @return 0 in case of success, 1 otherwise.
+/// @return 0 in case of success, 1 if the server is gone.
 int kvs_disconnect(int req_pipe,int resp_pipe);
 
 /// Requests a subscription for a key
 /// @param key Key to be subscribed
-/// @return 1 if the key was subscribed successfully (key existing), 0
-/// otherwise.
+/// @return 0 if the server replied, whose result is printed (1 if the key was
+/// subscribed, key existing, 0 otherwise), 1 if the server is gone.
 
 int kvs_subscribe(const char *key,int req_pipe,int resp_pipe);
 
 /// Remove a subscription for a key
 /// @param key Key to be unsubscribed
-/// @return 0 if the key was unsubscribed successfully  (subscription existed
-/// and was removed), 1 otherwise.
+/// @return 0 if the server replied, whose result is printed (1 if the
+/// subscription existed and was removed, 0 otherwise), 1 if the server is
+/// gone.
 
 int kvs_unsubscribe(const char *key,int req_pipe,int resp_pipe);
 
+/// Handles a notification of a logical channel: a key it subscribes and its
+/// new value, or "DELETED", the key being then no longer subscribed. Called
+/// by the thread reading notifications, so it must not call this API.
+typedef void (*kvs_notify_fn)(int channel, const char *key, const char *value,
+                              void *arg);
+
+/// Opens a logical channel in the session, subscribing keys of its own, so
+/// that many subscribers of a process share its pipes and its slot on the
+/// server (see MAX_CHANNELS). Nothing is sent until it subscribes a key.
+/// @param on_notify Handler of the notifications of its keys, not NULL.
+/// @param arg Passed to on_notify.
+/// @return The channel, -1 if MAX_CHANNELS - 1 are open.
+int kvs_open_channel(kvs_notify_fn on_notify, void *arg);
+
+/// Requests a subscription for a key on a channel, as kvs_subscribe does for
+/// the session, printing nothing.
+/// @param channel Channel opened by kvs_open_channel.
+/// @return 1 if subscribed (the key existing and the channel subscribing
+/// less than MAX_NUMBER_SUB), 0 otherwise, -1 if the server is gone.
+int kvs_channel_subscribe(int channel, const char *key, int req_pipe,
+                          int resp_pipe);
+
+/// Removes the subscription of a key on a channel, printing nothing.
+/// @return 1 if it existed and was removed, 0 otherwise, -1 if the server is
+/// gone.
+int kvs_channel_unsubscribe(int channel, const char *key, int req_pipe,
+                            int resp_pipe);
+
+/// Closes a channel, removing the subscriptions of its keys. Its handler is
+/// not called once this returns.
+/// @return 0 in case of success, 1 if the server is gone.
+int kvs_close_channel(int channel, int req_pipe, int resp_pipe);
+
+/// Writes key value pairs to the KVS.
+/// @param num_pairs Number of pairs, at most MAX_REQUEST_PAIRS.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings.
+/// @return 0 if the request was sent, its result being printed once the
+/// server replies (see kvs_pipeline), 1 if the server is gone or there are
+/// too many pairs.
+int kvs_write(size_t num_pairs, const char *keys[], const char *values[],
+              int req_pipe, int resp_pipe);
+
+/// Reads values from the KVS, printing them as a job would.
+/// @param num_keys Number of keys, at most MAX_REQUEST_PAIRS.
+/// @param keys Array of keys' strings.
+/// @return As kvs_write.
+int kvs_read(size_t num_keys, const char *keys[], int req_pipe,
+             int resp_pipe);
+
+/// Deletes key value pairs from the KVS, printing the keys missing as a job
+/// would.
+/// @param num_keys Number of keys, at most MAX_REQUEST_PAIRS.
+/// @param keys Array of keys' strings.
+/// @return As kvs_write.
+int kvs_delete(size_t num_keys, const char *keys[], int req_pipe,
+               int resp_pipe);
+
+/// Tells the server the client is still there, so that it does not end the
+/// session once idle for SESSION_IDLE_TIMEOUT. Prints nothing.
+/// @return 0 if the server replied, 1 if it is gone.
+int kvs_heartbeat(int req_pipe, int resp_pipe);
+
+/// Lets kvs_write, kvs_read and kvs_delete return before the server replies,
+/// up to a number of requests unanswered, so that the server has the next
+/// ones while it serves one. Their responses are read, in order, when more
+/// are sent, or by kvs_flush. The other requests wait for all of them.
+/// @param max_requests Most requests unanswered, up to
+/// MAX_PIPELINED_REQUESTS. 0, the default, waits for each response.
+void kvs_pipeline(size_t max_requests);
+
+/// Waits for the responses of every request sent, printing their results.
+/// @return 0 in case of success, 1 if the server is gone.
+int kvs_flush(int resp_pipe);
+
 void *notiThread(void *arg);
 
 #endif // CLIENT_API_H
@@ -2,6 +2,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,6 +20,46 @@
 
 void ensure_40_characters(char *str);
 
+// Ends the session when the server closed it, or is gone.
+static void server_gone(int req_pipe, int resp_pipe, const char *req_pipe_path,
+                        const char *resp_pipe_path,
+                        const char *notif_pipe_path) {
+  printf("Server unresponsive... Disconnecting...\n");
+  close(req_pipe);
+  close(resp_pipe);
+  unlink(notif_pipe_path);
+  unlink(resp_pipe_path);
+  unlink(req_pipe_path);
+}
+
+// Waits for the next command, sending heartbeats meanwhile (see
+// SESSION_IDLE_TIMEOUT).
+// @return 0 once there is input, 1 if the server is gone.
+static int wait_command(int req_pipe, int resp_pipe) {
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  while (SESSION_IDLE_TIMEOUT > 0 &&
+         poll(&pfd, 1, HEARTBEAT_INTERVAL_MS) == 0) {
+    if (kvs_heartbeat(req_pipe, resp_pipe)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Waits for a DELAY, sending heartbeats meanwhile.
+// @return 0 once waited, 1 if the server is gone.
+static int wait_delay(unsigned int delay_ms, int req_pipe, int resp_pipe) {
+  while (SESSION_IDLE_TIMEOUT > 0 && delay_ms > HEARTBEAT_INTERVAL_MS) {
+    delay(HEARTBEAT_INTERVAL_MS);
+    delay_ms -= HEARTBEAT_INTERVAL_MS;
+    if (kvs_heartbeat(req_pipe, resp_pipe)) {
+      return 1;
+    }
+  }
+  delay(delay_ms);
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
   if (argc < 3) {
     fprintf(stderr, "Usage: %s <client_unique_id> <register_pipe_path>\n",
@@ -30,6 +72,14 @@ int main(int argc, char *argv[]) {
   char notif_pipe_path[256] = "/tmp/notif";
 
   char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE] = {0};
+  // Of a WRITE, READ or DELETE
+  char data_keys[MAX_REQUEST_PAIRS][MAX_STRING_SIZE] = {0};
+  char data_values[MAX_REQUEST_PAIRS][MAX_STRING_SIZE] = {0};
+  const char *key_list[MAX_REQUEST_PAIRS], *value_list[MAX_REQUEST_PAIRS];
+  for (size_t i = 0; i < MAX_REQUEST_PAIRS; i++) {
+    key_list[i] = data_keys[i];
+    value_list[i] = data_values[i];
+  }
   unsigned int delay_ms;
   size_t num;
 
@@ -39,10 +89,16 @@ int main(int argc, char *argv[]) {
 
   // create pipes
   int req_pipe,resp_pipe;
-  mkfifo(notif_pipe_path, 0640);
-  mkfifo(req_pipe_path, 0640);
-  mkfifo(resp_pipe_path, 0640);
-  int res=kvs_connect(req_pipe_path,resp_pipe_path,argv[2],notif_pipe_path);
+  // not needed when the session uses the socket of the server
+  if (!SOCKET_TRANSPORT) {
+    mkfifo(notif_pipe_path, 0640);
+    mkfifo(req_pipe_path, 0640);
+    mkfifo(resp_pipe_path, 0640);
+  }
+  // A server gone while being written to is seen as EPIPE
+  signal(SIGPIPE, SIG_IGN);
+  int res=kvs_connect(req_pipe_path,resp_pipe_path,argv[2],notif_pipe_path,
+                      &req_pipe,&resp_pipe);
   if(res==1){
     printf("Connection failed try again later\n");
     unlink(notif_pipe_path);
@@ -50,28 +106,20 @@ int main(int argc, char *argv[]) {
     unlink(req_pipe_path);
     return 1;
   }
+  // The server gets the next WRITE, READ or DELETE while serving one
+  kvs_pipeline(MAX_PIPELINED_REQUESTS);
 
-  
   while (1) {
-    switch (get_next(STDIN_FILENO)) {
+    if (wait_command(req_pipe, resp_pipe)) {
+      server_gone(req_pipe, resp_pipe, req_pipe_path, resp_pipe_path,
+                  notif_pipe_path);
+      return 1;
+    }
+    enum Command cmd = get_next(STDIN_FILENO);
+    switch (cmd) {
     case CMD_DISCONNECT:
-      req_pipe=open(req_pipe_path,O_RDWR);
-      resp_pipe=open(resp_pipe_path, O_RDWR);
-      if(req_pipe<0){
-        printf("Server unresponsive... Disconnecting...\n");
-        close(req_pipe);
-        close(resp_pipe);
-        return 1;
-      }
-      if(resp_pipe<0){
-        printf("Server unresponsive... Disconnecting...\n");
-        close(req_pipe);
-        close(resp_pipe);
-        return 1;
-      }
       if (kvs_disconnect(req_pipe,resp_pipe) != 0) {
         fprintf(stderr, "Failed to disconnect to the server\n");
-        return 1;
       }
       
       unlink(notif_pipe_path);
@@ -84,57 +132,64 @@ int main(int argc, char *argv[]) {
 
     case CMD_SUBSCRIBE:
       num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
-      req_pipe=open(req_pipe_path,O_RDWR);
-      resp_pipe=open(resp_pipe_path, O_RDWR);
-      if(req_pipe<0){
-        printf("Server unresponsive... Disconnecting...\n");
-        close(req_pipe);
-        close(resp_pipe);
-        return 1;
-      }
-      if(resp_pipe<0){
-        printf("Server unresponsive... Disconnecting...\n");
-        close(req_pipe);
-        close(resp_pipe);
-        return 1;
-      }
       if (num == 0) {
         fprintf(stderr, "Invalid command. See HELP for usage\n");
         continue;
       }
 
       if (kvs_subscribe(keys[0],req_pipe,resp_pipe)!=0) {
-        fprintf(stderr, "Command subscribe failed\n");
-        close(req_pipe);
-        close(resp_pipe);
-        return 0;
+        server_gone(req_pipe, resp_pipe, req_pipe_path, resp_pipe_path,
+                    notif_pipe_path);
+        return 1;
       }
 
       break;
 
     case CMD_UNSUBSCRIBE:
       num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
-      req_pipe=open(req_pipe_path,O_RDWR);
-      resp_pipe=open(resp_pipe_path, O_RDWR);
-      if(req_pipe<0){
-        printf("Server unresponsive... Disconnecting...\n");
-        close(req_pipe);
-        close(resp_pipe);
+      if (num == 0) {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      if (kvs_unsubscribe(keys[0],req_pipe,resp_pipe)!=0) {
+        server_gone(req_pipe, resp_pipe, req_pipe_path, resp_pipe_path,
+                    notif_pipe_path);
         return 1;
       }
-      if(resp_pipe<0){
-        printf("Server unresponsive... Disconnecting...\n");
-        close(req_pipe);
-        close(resp_pipe);
+
+      break;
+
+    case CMD_WRITE:
+      num = parse_write(STDIN_FILENO, data_keys, data_values,
+                        MAX_REQUEST_PAIRS, MAX_STRING_SIZE - 1);
+      if (num == 0) {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+
+      if (kvs_write(num, key_list, value_list, req_pipe, resp_pipe) != 0) {
+        server_gone(req_pipe, resp_pipe, req_pipe_path, resp_pipe_path,
+                    notif_pipe_path);
         return 1;
       }
+
+      break;
+
+    case CMD_READ:
+    case CMD_DELETE:
+      num = parse_list(STDIN_FILENO, data_keys, MAX_REQUEST_PAIRS,
+                       MAX_STRING_SIZE - 1);
       if (num == 0) {
         fprintf(stderr, "Invalid command. See HELP for usage\n");
         continue;
       }
 
-      if (kvs_unsubscribe(keys[0],req_pipe,resp_pipe)!=0) {
-        fprintf(stderr, "Command subscribe failed\n");
+      if ((cmd == CMD_READ ? kvs_read : kvs_delete)(num, key_list, req_pipe,
+                                                    resp_pipe) != 0) {
+        server_gone(req_pipe, resp_pipe, req_pipe_path, resp_pipe_path,
+                    notif_pipe_path);
+        return 1;
       }
 
       break;
@@ -145,9 +200,20 @@ int main(int argc, char *argv[]) {
         continue;
       }
 
+      // The results of the requests sent come before the wait
+      if (kvs_flush(resp_pipe) != 0) {
+        server_gone(req_pipe, resp_pipe, req_pipe_path, resp_pipe_path,
+                    notif_pipe_path);
+        return 1;
+      }
+
       if (delay_ms > 0) {
         printf("Waiting...\n");
-        delay(delay_ms);
+        if (wait_delay(delay_ms, req_pipe, resp_pipe)) {
+          server_gone(req_pipe, resp_pipe, req_pipe_path, resp_pipe_path,
+                      notif_pipe_path);
+          return 1;
+        }
       }
       break;
 
@@ -160,6 +226,11 @@ int main(int argc, char *argv[]) {
 
     case EOC:
       // input should end in a disconnect, or it will loop here forever
+      if (kvs_flush(resp_pipe) != 0) {
+        server_gone(req_pipe, resp_pipe, req_pipe_path, resp_pipe_path,
+                    notif_pipe_path);
+        return 1;
+      }
       break;
     }
   }
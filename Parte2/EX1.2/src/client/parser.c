@@ -115,8 +115,35 @@ enum Command get_next(int fd) {
 
     return CMD_UNSUBSCRIBE;
 
+  case 'W':
+    if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "WRITE ", 6) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_WRITE;
+
+  case 'R':
+    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+
+    return CMD_READ;
+
   case 'D':
-    if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "DELAY ", 6) != 0) {
+    if (read(fd, buf + 1, 5) != 5) {
+      cleanup(fd);
+      return CMD_INVALID;
+    }
+    if (strncmp(buf, "DELETE", 6) == 0) {
+      if (read(fd, buf + 6, 1) != 1 || buf[6] != ' ') {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+      return CMD_DELETE;
+    }
+    if (strncmp(buf, "DELAY ", 6) != 0) {
       if (read(fd, buf + 6, 4) != 4 || strncmp(buf, "DISCONNECT", 10) != 0) {
         cleanup(fd);
         return CMD_INVALID;
@@ -143,6 +170,64 @@ enum Command get_next(int fd) {
   }
 }
 
+// Parses a "key,value)" pair.
+// @return 1 if parsed, 0 otherwise.
+static int parse_pair(int fd, char *key, char *value,
+                      size_t max_string_size) {
+  if (read_string(fd, key, max_string_size) != 0) {
+    return 0;
+  }
+
+  if (read_string(fd, value, max_string_size) != 1) {
+    return 0;
+  }
+
+  return 1;
+}
+
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
+                   char values[][MAX_STRING_SIZE], size_t max_pairs,
+                   size_t max_string_size) {
+  char ch;
+
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read(fd, &ch, 1) != 1 || ch != '(') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_pairs = 0;
+  while (1) {
+    if (num_pairs == max_pairs ||
+        parse_pair(fd, keys[num_pairs], values[num_pairs],
+                   max_string_size) == 0) {
+      cleanup(fd);
+      return 0;
+    }
+    num_pairs++;
+
+    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (ch == ']') {
+      break;
+    }
+  }
+
+  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 0;
+  }
+
+  return num_pairs;
+}
+
 size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
                   size_t max_string_size) {
   char ch;
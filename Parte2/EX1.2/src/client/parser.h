@@ -9,6 +9,9 @@ enum Command {
   CMD_DISCONNECT,
   CMD_SUBSCRIBE,
   CMD_UNSUBSCRIBE,
+  CMD_WRITE,
+  CMD_READ,
+  CMD_DELETE,
   CMD_DELAY,
   CMD_EMPTY,
   CMD_INVALID,
@@ -21,6 +24,18 @@ enum Command {
 // @return enum Command Command code.
 enum Command get_next(int fd);
 
+// Parses a list of key value pairs.
+// @param fd File descriptor to read from.
+// @param keys Array to store the keys.
+// @param values Array to store the values.
+// @param max_pairs Maximum number of pairs it will write.
+// @param max_string_size Maximum string size allowed.
+// @return 0 if the command was not parsed successfully, otherwise the number
+//          of pairs parsed
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
+                   char values[][MAX_STRING_SIZE], size_t max_pairs,
+                   size_t max_string_size);
+
 // Parses a list of strings
 // @param fd File descriptor to read from.
 // @param keys Array to store the keys
@@ -1,8 +1,39 @@
 // constantes partilhadas entre cliente e servidor
-#define MAX_SESSION_COUNT                                                      \
-  2 // num max de sessoes no server, 1 default, necessario alterar mais tarde
 #define STATE_ACCESS_DELAY_US   // delay a aplicar no server
 #define MAX_PIPE_PATH_LENGTH 40 // tamanho max do caminho do pipe
 #define MAX_STRING_SIZE 40
-#define MAX_NUMBER_SUB 10
-#define QUEUE_BUFFER_SIZE 10
+#define MAX_NUMBER_SUB 10 // chaves max subscritas por canal
+// canais lógicos max de uma sessão (ver protocol.h), incluindo o 0, o de
+// kvs_subscribe
+#define MAX_CHANNELS 1024
+#define QUEUE_BUFFER_SIZE 10 // capacidade por omissão da fila de ligações
+#define MAX_REQUEST_PAIRS 50 // pares/chaves max de um WRITE, READ ou DELETE
+// pedidos max enviados sem esperar pelas respostas: as respostas (no max
+// 4096 bytes cada) cabem no pipe, logo o servidor nunca bloqueia a responder
+#define MAX_PIPELINED_REQUESTS 16
+// ms que o servidor espera pelo resto de uma mensagem recebida em parte antes
+// de terminar a sessão, para que um cliente parado a meio não prenda a thread
+#define PARTIAL_MESSAGE_TIMEOUT_MS 1000
+// 1 (make SHM_TRANSPORT=1): os clientes pedem para trocar pedidos e respostas
+// por memória partilhada (ver ring.h) e o servidor aceita; senão, pelos pipes
+#ifndef SHM_TRANSPORT
+#define SHM_TRANSPORT 0
+#endif
+// 1 (make SOCKET_TRANSPORT=1): o servidor aceita também sessões num socket
+// Unix (<pipe de registo>.sock), uma ligação por sessão em vez de 3 pipes, e
+// os clientes ligam-se por ele
+#ifndef SOCKET_TRANSPORT
+#define SOCKET_TRANSPORT 0
+#endif
+// tamanho dos buffers de envio e receção dos sockets (make
+// SOCKET_BUFFER_SIZE=...), 0 para o do sistema; nunca menos que BATCH_SIZE
+#ifndef SOCKET_BUFFER_SIZE
+#define SOCKET_BUFFER_SIZE 0
+#endif
+// segundos sem pedidos após os quais o servidor termina uma sessão (make
+// SESSION_IDLE_TIMEOUT=...), 0 para nunca; os clientes inativos enviam
+// heartbeats a cada HEARTBEAT_INTERVAL_MS para a manter
+#ifndef SESSION_IDLE_TIMEOUT
+#define SESSION_IDLE_TIMEOUT 0
+#endif
+#define HEARTBEAT_INTERVAL_MS (SESSION_IDLE_TIMEOUT * 1000 / 3)
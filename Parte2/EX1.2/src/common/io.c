@@ -4,11 +4,14 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -32,6 +35,14 @@ int read_all(int fd, void *buffer, size_t size, int *intr) {
         }
         continue;
       }
+      if (errno == EAGAIN) {
+        // A non-blocking descriptor, waited for a while all the same
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, PARTIAL_MESSAGE_TIMEOUT_MS) != 0) {
+          continue;
+        }
+        errno = EAGAIN;
+      }
       perror("Failed to read from pipe");
       return -1;
     } else if (result == 0) {
@@ -76,6 +87,172 @@ int write_all(int fd, const void *buffer, size_t size) {
   return 1;
 }
 
+int send_message(int fd, const message_header_t *header, const void *payload) {
+  char buffer[sizeof(message_header_t) + MAX_PAYLOAD_SIZE];
+  if (header->payload_size > MAX_PAYLOAD_SIZE) {
+    return -1;
+  }
+  memcpy(buffer, header, sizeof(message_header_t));
+  if (header->payload_size > 0) {
+    memcpy(buffer + sizeof(message_header_t), payload, header->payload_size);
+  }
+  return write_all(fd, buffer, sizeof(message_header_t) + header->payload_size);
+}
+
+void batch_init(message_batch_t *batch, int socket) {
+  batch->socket = socket;
+  batch->size = batch->pos = 0;
+}
+
+int batch_add(message_batch_t *batch, int fd, const message_header_t *header,
+              const void *payload) {
+  size_t size = sizeof(message_header_t) + header->payload_size;
+  if (header->payload_size > MAX_PAYLOAD_SIZE) {
+    return -1;
+  }
+  if (batch->size + size > BATCH_SIZE && send_batch(batch, fd) < 0) {
+    return -1;
+  }
+  memcpy(batch->data + batch->size, header, sizeof(message_header_t));
+  if (header->payload_size > 0) {
+    memcpy(batch->data + batch->size + sizeof(message_header_t), payload,
+           header->payload_size);
+  }
+  batch->size += size;
+  return 1;
+}
+
+int send_batch(message_batch_t *batch, int fd) {
+  size_t sent = 0;
+  size_t size = batch->size;
+  batch->size = 0;
+  if (!batch->socket) {
+    return size > 0 ? write_all(fd, batch->data, size) : 1;
+  }
+  while (sent < size) {
+    struct iovec iov = {batch->data + sent, size - sent};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    ssize_t bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    sent += (size_t)bytes;
+  }
+  return 1;
+}
+
+int receive_batch(message_batch_t *batch, int fd, int wait) {
+  memmove(batch->data, batch->data + batch->pos, batch->size - batch->pos);
+  batch->size -= batch->pos;
+  batch->pos = 0;
+  // Leaves room for the rest of a message received in part
+  if (batch->size + 4096 >= BATCH_SIZE) {
+    return 1;
+  }
+  struct iovec iov = {batch->data + batch->size,
+                      BATCH_SIZE - 4096 - batch->size};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  ssize_t bytes;
+  do {
+    bytes = recvmsg(fd, &msg, wait ? 0 : MSG_DONTWAIT);
+  } while (bytes < 0 && errno == EINTR);
+  if (bytes <= 0) {
+    return (int)bytes;
+  }
+  batch->size += (size_t)bytes;
+
+  size_t end = 0; // of the last message, if whole
+  message_header_t header;
+  while (end < batch->size) {
+    if (batch->size - end < sizeof(header)) {
+      size_t missing = sizeof(header) - (batch->size - end);
+      int result = read_all(fd, batch->data + batch->size, missing, NULL);
+      if (result <= 0) {
+        return result;
+      }
+      batch->size += missing;
+    }
+    memcpy(&header, batch->data + end, sizeof(header));
+    if (header.payload_size > MAX_PAYLOAD_SIZE) {
+      errno = EPROTO;
+      return -1;
+    }
+    end += sizeof(header) + header.payload_size;
+  }
+  if (end > batch->size) {
+    int result = read_all(fd, batch->data + batch->size, end - batch->size,
+                          NULL);
+    if (result <= 0) {
+      return result;
+    }
+    batch->size = end;
+  }
+  return 1;
+}
+
+int batch_peek(const message_batch_t *batch, message_header_t *header) {
+  if (batch->size - batch->pos < sizeof(message_header_t)) {
+    return 0;
+  }
+  memcpy(header, batch->data + batch->pos, sizeof(message_header_t));
+  return 1;
+}
+
+int batch_pop(message_batch_t *batch, message_header_t *header, void *payload,
+              size_t max_size) {
+  if (!batch_peek(batch, header)) {
+    return 0;
+  }
+  const char *start = batch->data + batch->pos + sizeof(message_header_t);
+  batch->pos += sizeof(message_header_t) + header->payload_size;
+  if (header->payload_size > max_size) {
+    return -2;
+  }
+  memcpy(payload, start, header->payload_size);
+  return 1;
+}
+
+void set_socket_buffers(int fd) {
+  if (SOCKET_BUFFER_SIZE > 0) {
+    // Never less than the responses a client may leave unread
+    int size = SOCKET_BUFFER_SIZE > BATCH_SIZE ? SOCKET_BUFFER_SIZE
+                                               : BATCH_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  }
+}
+
+int receive_message(int fd, message_header_t *header, void *payload,
+                    size_t max_size, int *intr) {
+  int result = read_all(fd, header, sizeof(message_header_t), intr);
+  if (result <= 0) {
+    return result;
+  }
+  if (header->payload_size > max_size) {
+    fprintf(stderr, "Message payload too large: %u bytes\n",
+            header->payload_size);
+    // Skipped, so the next message is read from its start
+    char skipped[256];
+    for (size_t left = header->payload_size; left > 0;) {
+      size_t size = left < sizeof(skipped) ? left : sizeof(skipped);
+      if (read_all(fd, skipped, size, intr) <= 0) {
+        break;
+      }
+      left -= size;
+    }
+    return -2;
+  }
+  if (header->payload_size == 0) {
+    return 1;
+  }
+  // A header without its payload is a message cut short
+  result = read_all(fd, payload, header->payload_size, intr);
+  return result == 0 ? -1 : result;
+}
+
 static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
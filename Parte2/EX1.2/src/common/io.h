@@ -3,8 +3,13 @@
 
 #include <stddef.h>
 
+#include "constants.h"
+#include "protocol.h"
+
 /// Reads a given number of bytes from a file descriptor. Will block until all
-/// bytes are read, or fail if not all bytes could be read.
+/// bytes are read, or fail if not all bytes could be read. From a non-blocking
+/// descriptor, fails with EAGAIN once nothing came for
+/// PARTIAL_MESSAGE_TIMEOUT_MS.
 /// @param fd File descriptor to read from.
 /// @param buffer Buffer to read into.
 /// @param size Number of bytes to read.
@@ -24,6 +29,85 @@ int read_string(int fd, char *str);
 /// @return On success, returns 1, on error, returns -1
 int write_all(int fd, const void *buffer, size_t size);
 
+/// Writes a message (see protocol.h) with a single write, so it is not
+/// interleaved with others written to the same pipe.
+/// @param fd File descriptor to write to.
+/// @param header Header of the message, with the size of the payload.
+/// @param payload Payload of the message, header->payload_size bytes.
+/// @return On success, returns 1, on error (EPIPE if the reader is gone), or if
+/// the payload is larger than MAX_PAYLOAD_SIZE, returns -1
+int send_message(int fd, const message_header_t *header, const void *payload);
+
+/// Reads a message (see protocol.h): its header, then its payload.
+/// @param fd File descriptor to read from.
+/// @param header Where to store the header.
+/// @param payload Buffer for the payload.
+/// @param max_size Size of the buffer, at most MAX_PAYLOAD_SIZE.
+/// @param intr See read_all.
+/// @return On success, returns 1, on end of file, returns 0, on error, returns
+/// -1, and if the payload does not fit in the buffer, it is skipped and
+/// returns -2
+int receive_message(int fd, message_header_t *header, void *payload,
+                    size_t max_size, int *intr);
+
+// Bytes of a message_batch_t: MAX_PIPELINED_REQUESTS messages of the largest
+// size
+#define BATCH_SIZE (MAX_PIPELINED_REQUESTS * 4096)
+
+/// Messages gathered to be sent at once (see batch_add), or received at once
+/// from a socket (see receive_batch).
+typedef struct message_batch {
+  int socket; // sent with sendmsg, else written
+  size_t size;
+  size_t pos; // of the next message received to pop
+  char data[BATCH_SIZE];
+} message_batch_t;
+
+/// Empties a batch.
+/// @param socket Whether it will be sent to a socket.
+void batch_init(message_batch_t *batch, int socket);
+
+/// Adds a message (see protocol.h) to a batch, sending the batch first if it
+/// has no room for it.
+/// @param fd File descriptor the batch is sent to.
+/// @return On success, returns 1, on error, returns -1 (as send_batch)
+int batch_add(message_batch_t *batch, int fd, const message_header_t *header,
+              const void *payload);
+
+/// Sends the messages of a batch, with a single sendmsg (or write) unless the
+/// other end takes them in parts, and empties it.
+/// @param fd File descriptor to send to.
+/// @return On success, returns 1, on error (EPIPE if the reader is gone),
+/// returns -1
+int send_batch(message_batch_t *batch, int fd);
+
+/// Receives, with a single recvmsg, the messages a socket has (as much as
+/// fits in a batch), after the ones not popped yet. A message received in
+/// part is then read whole, so the batch only has whole messages.
+/// @param fd Socket to receive from.
+/// @param wait Whether to block until there is something to receive.
+/// @return On success, returns 1, on end of file, returns 0, on error (EAGAIN
+/// if there was nothing and not waiting, EPROTO if a message is too large),
+/// returns -1
+int receive_batch(message_batch_t *batch, int fd, int wait);
+
+/// Reads the header of the next message received, without popping it.
+/// @return 1 if there is one, 0 if the messages received were all popped.
+int batch_peek(const message_batch_t *batch, message_header_t *header);
+
+/// Pops the next message received (see receive_batch).
+/// @param header Where to store the header.
+/// @param payload Buffer for the payload.
+/// @param max_size Size of the buffer.
+/// @return 1 if popped, 0 if there is none, -2 if the payload does not fit in
+/// the buffer (it is then skipped)
+int batch_pop(message_batch_t *batch, message_header_t *header, void *payload,
+              size_t max_size);
+
+/// Sets the send and receive buffers of a socket to SOCKET_BUFFER_SIZE, unless
+/// it is 0 (the system default is kept).
+void set_socket_buffers(int fd);
+
 void delay(unsigned int time_ms);
 
 /// @brief Attempts to initialize register fifo pipe
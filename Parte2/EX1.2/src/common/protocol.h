@@ -1,13 +1,75 @@
 #ifndef COMMON_PROTOCOL_H
 #define COMMON_PROTOCOL_H
 
+#include <stdint.h>
+
 // Opcodes for client-server communication
 // estes opcodes sao usados num switch case para determinar o que fazer com a
 // mensagem recebida no server usam estes opcodes tambem nos clientes quando
 // enviam mensagens para o server
 enum {
   OP_CODE_CONNECT = 1,
-  // TODO mais opcodes para cada operacao
+  OP_CODE_DISCONNECT = 2,
+  OP_CODE_SUBSCRIBE = 3,
+  OP_CODE_UNSUBSCRIBE = 4,
+  OP_CODE_NOTIFY = 5, // server to client, on the notification pipe
+  OP_CODE_WRITE = 6,
+  OP_CODE_READ = 7,
+  OP_CODE_DELETE = 8,
+  OP_CODE_HEARTBEAT = 9,
+  OP_CODE_CLOSE_CHANNEL = 10,
 };
 
+// Every message, in either direction, is a header followed by payload_size
+// bytes of payload. Both ends are on the same host, so the fields are in its
+// byte order.
+//
+// Requests and their payloads:
+//   CONNECT      the request, response and notification pipe paths, each
+//                ended by '\0' (on the register pipe), maybe followed by the
+//                name of shared memory offered (see ring.h), ended by '\0'.
+//                Then the response has a byte: 1 if it carries the requests
+//                and responses from then on, 0 if the pipes still do
+//                A client connecting to the socket of the server instead
+//                (see SOCKET_TRANSPORT) sends none: the response comes once
+//                the connection is accepted, and the connection then carries
+//                the requests, responses and notifications of the session
+//   DISCONNECT   none
+//   SUBSCRIBE    the key, without a '\0'
+//   UNSUBSCRIBE  the key, without a '\0'
+//   WRITE        each key and its value, each ended by '\0'
+//   READ         each key, ended by '\0'
+//   DELETE       each key, ended by '\0'
+//   HEARTBEAT    none: it only tells the server the client is still there,
+//                as every request does (see SESSION_IDLE_TIMEOUT)
+//   CLOSE_CHANNEL none: unsubscribes every key of its channel, the number
+//                of them being the result
+// (at most MAX_REQUEST_PAIRS pairs or keys).
+// Each is answered on the response pipe by a header with the same opcode and
+// request_id (0 for CONNECT) and the outcome in result. The payload of the
+// response to a READ or DELETE is its output, as a job would write it (none
+// for a DELETE of keys that all existed); the others have none.
+// A client may send several requests before reading their responses, which
+// come in the order of the requests.
+// A NOTIFY has the key and its new value, or "DELETED", each ended by '\0'.
+//
+// A session carries up to MAX_CHANNELS logical channels, each subscribing its
+// own keys: SUBSCRIBE, UNSUBSCRIBE and CLOSE_CHANNEL apply to the channel of
+// their header, and the NOTIFY of a key is sent once per channel subscribing
+// it, with that channel. Channels need not be opened, one with no keys has
+// nothing on the server. The other requests may come on any channel, and
+// every response has the channel of its request.
+typedef struct {
+  uint8_t opcode;
+  uint8_t result;   // responses only
+  uint16_t channel; // logical channel of the session, 0 if only one
+  uint32_t request_id; // chosen by the client, echoed in the response
+  uint32_t payload_size;
+} message_header_t;
+
+// Largest payload accepted. A whole message then fits in PIPE_BUF, so
+// messages written at once to a pipe shared by several writers (the register
+// pipe) are never interleaved.
+#define MAX_PAYLOAD_SIZE (4096 - sizeof(message_header_t))
+
 #endif // COMMON_PROTOCOL_H
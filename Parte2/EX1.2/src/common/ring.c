@@ -0,0 +1,143 @@
+// futex has no glibc wrapper, it is called through syscall(), which needs the
+// GNU extensions
+#define _GNU_SOURCE
+#include "ring.h"
+
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Times a consumer checks an empty ring before going idle, when another CPU
+// may be writing to it
+#define RING_SPINS 4000
+
+// Whether spinning may see a message come: not with a single CPU, where the
+// producer only runs once the consumer stops.
+static int can_spin() {
+  static long cpus = 0;
+  long known = __atomic_load_n(&cpus, __ATOMIC_RELAXED);
+  if (known == 0) {
+    known = sysconf(_SC_NPROCESSORS_ONLN);
+    __atomic_store_n(&cpus, known, __ATOMIC_RELAXED);
+  }
+  return known > 1;
+}
+
+void ring_init(ring_t *ring, int idle) {
+  ring->head = 0;
+  ring->tail = 0;
+  ring->idle = idle ? 1 : 0;
+}
+
+// Copies into a ring at a position, wrapping around its end.
+static void copy_in(ring_t *ring, uint32_t pos, const void *src, size_t size) {
+  size_t offset = pos % RING_SIZE;
+  size_t first = size < RING_SIZE - offset ? size : RING_SIZE - offset;
+  memcpy(ring->data + offset, src, first);
+  memcpy(ring->data, (const unsigned char *)src + first, size - first);
+}
+
+// Copies out of a ring at a position, wrapping around its end.
+static void copy_out(const ring_t *ring, uint32_t pos, void *dst,
+                     size_t size) {
+  size_t offset = pos % RING_SIZE;
+  size_t first = size < RING_SIZE - offset ? size : RING_SIZE - offset;
+  memcpy(dst, ring->data + offset, first);
+  memcpy((unsigned char *)dst + first, ring->data, size - first);
+}
+
+int ring_push(ring_t *ring, const message_header_t *header,
+              const void *payload) {
+  uint32_t tail = ring->tail; // only written here
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  size_t size = sizeof(*header) + header->payload_size;
+  if (header->payload_size > MAX_PAYLOAD_SIZE ||
+      (uint32_t)(tail - head) > RING_SIZE - size) {
+    return 0;
+  }
+
+  copy_in(ring, tail, header, sizeof(*header));
+  copy_in(ring, tail + (uint32_t)sizeof(*header), payload,
+          header->payload_size);
+  __atomic_store_n(&ring->tail, tail + (uint32_t)size, __ATOMIC_SEQ_CST);
+  return 1;
+}
+
+int ring_wake_needed(ring_t *ring) {
+  // Seen after tail is written (both sequentially consistent), so a consumer
+  // that went idle before has either seen the message, or is woken up
+  return __atomic_load_n(&ring->idle, __ATOMIC_SEQ_CST) &&
+         __atomic_exchange_n(&ring->idle, 0, __ATOMIC_SEQ_CST);
+}
+
+int ring_pop(ring_t *ring, message_header_t *header, void *payload,
+             size_t max_size) {
+  uint32_t head = ring->head; // only written here
+  uint32_t used = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+  if (used == 0) {
+    return 0;
+  }
+  // The other end may be another process, writing anything
+  if (used > RING_SIZE || used < sizeof(*header)) {
+    return -1;
+  }
+  copy_out(ring, head, header, sizeof(*header));
+  size_t size = sizeof(*header) + header->payload_size;
+  if (header->payload_size > used - sizeof(*header)) {
+    return -1;
+  }
+
+  int result = 1;
+  if (header->payload_size > max_size) {
+    result = -2;
+  } else {
+    copy_out(ring, head + (uint32_t)sizeof(*header), payload,
+             header->payload_size);
+  }
+  __atomic_store_n(&ring->head, head + (uint32_t)size, __ATOMIC_RELEASE);
+  return result;
+}
+
+// Whether a ring has a message, read by its consumer.
+static int ring_ready(ring_t *ring) {
+  return __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != ring->head;
+}
+
+int ring_idle(ring_t *ring) {
+  if (can_spin()) {
+    for (int i = 0; i < RING_SPINS; i++) {
+      if (ring_ready(ring)) {
+        return 0;
+      }
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#endif
+    }
+  }
+
+  __atomic_store_n(&ring->idle, 1, __ATOMIC_SEQ_CST);
+  if (ring_ready(ring)) {
+    // Taken back, unless the producer saw it already and will wake us up
+    __atomic_store_n(&ring->idle, 0, __ATOMIC_SEQ_CST);
+    return 0;
+  }
+  return 1;
+}
+
+int ring_wait(ring_t *ring, int timeout_ms) {
+  if (!ring_idle(ring)) {
+    return 1;
+  }
+  struct timespec timeout = {timeout_ms / 1000,
+                             (timeout_ms % 1000) * 1000000L};
+  // Does not sleep if tail moved since it was seen empty
+  syscall(SYS_futex, &ring->tail, FUTEX_WAIT, ring->head, &timeout, NULL, 0);
+  __atomic_store_n(&ring->idle, 0, __ATOMIC_SEQ_CST);
+  return ring_ready(ring);
+}
+
+void ring_wake(ring_t *ring) {
+  syscall(SYS_futex, &ring->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
@@ -0,0 +1,81 @@
+#ifndef COMMON_RING_H
+#define COMMON_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "protocol.h"
+
+// Bytes of a ring: MAX_PIPELINED_REQUESTS messages of the largest size, the
+// most a client may leave unanswered
+#define RING_SIZE (MAX_PIPELINED_REQUESTS * 4096)
+
+// Written in a shm_channel_t by the client that created it
+#define SHM_CHANNEL_MAGIC 0x6b767363
+
+/// Messages (see protocol.h) from a single producer to a single consumer,
+/// in memory shared by both. Neither locks: each only moves its own
+/// counter.
+typedef struct {
+  // Bytes read by the consumer, ever (it wraps around)
+  uint32_t head;
+  char head_pad[60]; // so that the producer writing tail does not slow
+                     // down the consumer reading head, and the other way
+  // Bytes written by the producer, ever. The consumer sleeps on it (futex)
+  uint32_t tail;
+  // Set by the consumer before it sleeps, cleared by the one waking it up
+  uint32_t idle;
+  char tail_pad[56];
+  unsigned char data[RING_SIZE];
+} ring_t;
+
+/// Memory shared by a client and the server, in place of the request and
+/// response pipes of a session (see kvs_connect).
+typedef struct {
+  uint32_t magic;
+  uint32_t size; // sizeof(shm_channel_t)
+  ring_t requests;
+  ring_t responses;
+} shm_channel_t;
+
+/// Initializes an empty ring.
+/// @param idle Whether its consumer starts idle, to be woken up by the first
+/// message.
+void ring_init(ring_t *ring, int idle);
+
+/// Writes a message to a ring, never blocking.
+/// @param header Header of the message, with the size of the payload.
+/// @param payload Payload of the message, header->payload_size bytes.
+/// @return 1 if written, then wake it with ring_wake if this returns 1, 0 if
+/// there is no room for it (or the ring is corrupt).
+int ring_push(ring_t *ring, const message_header_t *header,
+              const void *payload);
+
+/// Whether the consumer of a ring went idle and must be woken up, after a
+/// ring_push. Only the first caller after it went idle gets 1.
+int ring_wake_needed(ring_t *ring);
+
+/// Reads a message from a ring, never blocking.
+/// @param header Where to store the header of the message.
+/// @param payload Where to store the payload of the message.
+/// @param max_size Size of payload.
+/// @return 1 if read, 0 if the ring is empty, -2 if the payload was larger
+/// than max_size (it is then skipped), -1 if the ring is corrupt.
+int ring_pop(ring_t *ring, message_header_t *header, void *payload,
+             size_t max_size);
+
+/// Goes idle when a ring is empty, after spinning on it a while if other CPUs
+/// may be writing to it. The producer then wakes the consumer up.
+/// @return 1 if idle, 0 if a message came (read it with ring_pop).
+int ring_idle(ring_t *ring);
+
+/// Waits until a ring is not empty, sleeping on it (futex) once idle.
+/// @param timeout_ms Most milliseconds to sleep for.
+/// @return 1 if a message came, 0 if the time is up.
+int ring_wait(ring_t *ring, int timeout_ms);
+
+/// Wakes up the consumer of a ring sleeping in ring_wait.
+void ring_wake(ring_t *ring);
+
+#endif // COMMON_RING_H
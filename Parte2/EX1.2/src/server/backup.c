@@ -0,0 +1,204 @@
+// pidfd_open has no glibc wrapper on older systems, it is called through
+// syscall(), which needs the GNU extensions
+#define _GNU_SOURCE
+#include "backup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Interval used to poll for backups whose pidfd could not be opened
+#define BACKUP_POLL_INTERVAL_MS 100
+
+typedef struct {
+  pid_t pid;
+  int pidfd;
+} backup_t;
+
+static struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t slot_freed; // signalled when an active backup ends
+  backup_t *active;       // array with max_backups slots
+  size_t active_count;
+  size_t reserved;        // slots taken by backups not forked yet
+  size_t max_backups;
+  int wake_pipe[2];       // wakes the scheduler when a backup is started
+  int terminate;
+} scheduler;
+
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  return -1;
+#endif
+}
+
+// Removes an active backup, whose process has already been reaped, freeing
+// its slot. Must be called with scheduler.mutex locked.
+static void remove_active(size_t index) {
+  if (scheduler.active[index].pidfd >= 0) {
+    close(scheduler.active[index].pidfd);
+  }
+  scheduler.active[index] = scheduler.active[--scheduler.active_count];
+  pthread_cond_signal(&scheduler.slot_freed);
+}
+
+static void *scheduler_thread(void *arg) {
+  (void)arg;
+  struct pollfd *fds = malloc((scheduler.max_backups + 1) * sizeof(*fds));
+  if (fds == NULL) {
+    fprintf(stderr, "Failed to allocate backup scheduler\n");
+    return NULL;
+  }
+
+  while (1) {
+    pthread_mutex_lock(&scheduler.mutex);
+    if (scheduler.terminate && scheduler.active_count == 0 &&
+        scheduler.reserved == 0) {
+      pthread_mutex_unlock(&scheduler.mutex);
+      break;
+    }
+
+    int timeout = -1;
+    nfds_t nfds = 1;
+    fds[0].fd = scheduler.wake_pipe[0];
+    fds[0].events = POLLIN;
+    for (size_t i = 0; i < scheduler.active_count; i++) {
+      // a negative fd is ignored by poll, those are checked with WNOHANG
+      fds[nfds].fd = scheduler.active[i].pidfd;
+      fds[nfds++].events = POLLIN;
+      if (scheduler.active[i].pidfd < 0) {
+        timeout = BACKUP_POLL_INTERVAL_MS;
+      }
+    }
+    pthread_mutex_unlock(&scheduler.mutex);
+
+    if (poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+      perror("Backup scheduler poll failed");
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      char buf[64];
+      if (read(scheduler.wake_pipe[0], buf, sizeof(buf)) < 0) {
+        perror("Failed to read backup scheduler pipe");
+      }
+    }
+
+    pthread_mutex_lock(&scheduler.mutex);
+    // Only this thread removes active backups, so the order of active[] still
+    // matches fds[1..] up to the first removal; walk backwards to keep it so
+    for (size_t i = nfds - 1; i > 0; i--) {
+      backup_t *backup = &scheduler.active[i - 1];
+      if (backup->pidfd >= 0 && !(fds[i].revents & (POLLIN | POLLHUP))) {
+        continue;
+      }
+      pid_t reaped =
+          waitpid(backup->pid, NULL, backup->pidfd >= 0 ? 0 : WNOHANG);
+      if (reaped == backup->pid || (reaped < 0 && errno == ECHILD)) {
+        remove_active(i - 1);
+      }
+    }
+    pthread_mutex_unlock(&scheduler.mutex);
+  }
+
+  free(fds);
+  return NULL;
+}
+
+int backup_scheduler_init(size_t max_backups) {
+  scheduler.max_backups = max_backups;
+  scheduler.active = malloc(max_backups * sizeof(backup_t));
+  if (scheduler.active == NULL) {
+    return 1;
+  }
+  if (pthread_mutex_init(&scheduler.mutex, NULL) ||
+      pthread_cond_init(&scheduler.slot_freed, NULL)) {
+    return 1;
+  }
+  if (pipe(scheduler.wake_pipe)) {
+    return 1;
+  }
+  // a full pipe already guarantees a wake up, so producers never block on it
+  if (fcntl(scheduler.wake_pipe[1], F_SETFL, O_NONBLOCK)) {
+    return 1;
+  }
+  if (pthread_create(&scheduler.thread, NULL, scheduler_thread, NULL)) {
+    return 1;
+  }
+  return 0;
+}
+
+void backup_scheduler_terminate() {
+  pthread_mutex_lock(&scheduler.mutex);
+  scheduler.terminate = 1;
+  pthread_mutex_unlock(&scheduler.mutex);
+  if (write(scheduler.wake_pipe[1], "1", 1) != 1) {
+    perror("Failed to wake backup scheduler");
+  }
+
+  pthread_join(scheduler.thread, NULL);
+  close(scheduler.wake_pipe[0]);
+  close(scheduler.wake_pipe[1]);
+  pthread_cond_destroy(&scheduler.slot_freed);
+  pthread_mutex_destroy(&scheduler.mutex);
+  free(scheduler.active);
+  scheduler.active = NULL;
+}
+
+void backup_reserve() {
+  pthread_mutex_lock(&scheduler.mutex);
+  while (scheduler.active_count + scheduler.reserved >= scheduler.max_backups) {
+    pthread_cond_wait(&scheduler.slot_freed, &scheduler.mutex);
+  }
+  scheduler.reserved++;
+  pthread_mutex_unlock(&scheduler.mutex);
+}
+
+void backup_cancel() {
+  pthread_mutex_lock(&scheduler.mutex);
+  scheduler.reserved--;
+  pthread_cond_signal(&scheduler.slot_freed);
+  pthread_mutex_unlock(&scheduler.mutex);
+  // May be the last thing terminate waits for
+  if (write(scheduler.wake_pipe[1], "1", 1) != 1 && errno != EAGAIN) {
+    perror("Failed to wake backup scheduler");
+  }
+}
+
+void backup_started(pid_t pid) {
+  pthread_mutex_lock(&scheduler.mutex);
+  scheduler.reserved--;
+  backup_t *slot = &scheduler.active[scheduler.active_count++];
+  slot->pid = pid;
+  slot->pidfd = open_pidfd(pid);
+  pthread_mutex_unlock(&scheduler.mutex);
+
+  if (write(scheduler.wake_pipe[1], "1", 1) != 1 && errno != EAGAIN) {
+    perror("Failed to wake backup scheduler");
+  }
+}
+
+void backup_close_fds() {
+#ifdef SYS_close_range
+  if (syscall(SYS_close_range, 3U, ~0U, 0U) == 0) {
+    return;
+  }
+#endif
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    for (rlim_t fd = 3; fd < limit.rlim_cur; fd++) {
+      close((int)fd);
+    }
+  }
+}
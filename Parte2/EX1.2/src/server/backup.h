@@ -0,0 +1,34 @@
+#ifndef SERVER_BACKUP_H
+#define SERVER_BACKUP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/// @brief Starts the backup scheduler thread.
+/// @param max_backups Maximum number of backups writing at the same time.
+/// @return 0 if no errors, 1 otherwise
+int backup_scheduler_init(size_t max_backups);
+
+/// @brief Waits for every scheduled backup to finish and stops the scheduler.
+void backup_scheduler_terminate();
+
+/// @brief Waits until less than max_backups backups are running, and takes a
+/// slot for the next one, to be forked then: each backup process is a copy of
+/// the table, so no more than max_backups ever exist.
+void backup_reserve();
+
+/// @brief Gives back a slot taken by backup_reserve for a backup that was not
+/// forked.
+void backup_cancel();
+
+/// @brief Hands a backup process, forked in a slot taken by backup_reserve, to
+/// the scheduler, which waits for it to end to free the slot. Never blocks.
+/// @param pid Process id of the backup process.
+void backup_started(pid_t pid);
+
+/// @brief Closes every descriptor but the standard ones, in a forked backup
+/// process, so it keeps no session's pipes or socket open (their clients
+/// would not see them closed). Async signal safe.
+void backup_close_fds();
+
+#endif  // SERVER_BACKUP_H
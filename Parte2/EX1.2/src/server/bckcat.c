@@ -0,0 +1,30 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "compress.h"
+
+// Prints backup files as plain text, whether they were written compressed
+// (BACKUP_COMPRESSION) or not.
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <backup_file>...\n", argv[0]);
+    return 1;
+  }
+
+  int result = 0;
+  for (int i = 1; i < argc; i++) {
+    int fd = open(argv[i], O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "Failed to open backup file: %s\n", argv[i]);
+      result = 1;
+      continue;
+    }
+    if (decompress_stream(fd, STDOUT_FILENO)) {
+      fprintf(stderr, "Failed to read backup file: %s\n", argv[i]);
+      result = 1;
+    }
+    close(fd);
+  }
+  return result;
+}
@@ -0,0 +1,24 @@
+#!/bin/bash
+# Writes a job of WRITEs of random keys and values, of about the size asked,
+# to measure the parser with (see the bench target of the Makefile). The same
+# size always gives the same job.
+# usage: bench/gen_job.sh <megabytes> > <job_file>
+MB=${1:?usage: $0 <megabytes>}
+PAIRS=1000 # per WRITE, in 4 chunks
+KEYS=100000
+
+awk -v bytes=$((MB * 1000000)) -v pairs=$PAIRS -v keys=$KEYS 'BEGIN {
+  srand(1)
+  written = 0
+  while (written < bytes) {
+    line = "WRITE ["
+    for (p = 0; p < pairs; p++) {
+      # Values of 4 to 24 characters, keys of up to 8
+      value = substr("abcdefghijklmnopqrstuvwxyz", 1, 4 + int(rand() * 21))
+      line = line "(key" int(rand() * keys) "," value ")"
+    }
+    line = line "]"
+    print line
+    written += length(line) + 1
+  }
+}'
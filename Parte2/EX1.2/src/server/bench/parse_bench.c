@@ -0,0 +1,95 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../constants.h"
+#include "../parser.h"
+
+// Parses a job to its end as a job's parser does, without executing it.
+// @param fd File descriptor of the job, at its start.
+// @return Number of pairs, keys and delays parsed, so none of it is skipped.
+static size_t parse_job(int fd) {
+  job_reader_t reader;
+  const char *keys[MAX_WRITE_SIZE];
+  const char *values[MAX_WRITE_SIZE];
+  unsigned int delay;
+  size_t parsed = 0;
+  enum Command cmd;
+
+  if (job_reader_init(&reader, fd) != 0) {
+    return 0;
+  }
+  while ((cmd = get_next(&reader)) != EOC) {
+    int more = 0;
+    switch (cmd) {
+    case CMD_WRITE:
+      do {
+        parsed += parse_write(&reader, keys, values, MAX_WRITE_SIZE,
+                              MAX_STRING_SIZE, &more);
+      } while (more);
+      break;
+
+    case CMD_READ:
+    case CMD_DELETE:
+      do {
+        parsed += parse_read_delete(&reader, keys, MAX_WRITE_SIZE,
+                                    MAX_STRING_SIZE, &more);
+      } while (more);
+      break;
+
+    case CMD_WAIT:
+      parsed += parse_wait(&reader, &delay, NULL) == 0;
+      break;
+
+    case CMD_SHOW:
+    case CMD_BACKUP:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+    case EOC:
+      break;
+    }
+  }
+  job_reader_destroy(&reader);
+  return parsed;
+}
+
+// Prints the parse-only throughput of the job parser on a job file, the best
+// of a few runs, so it is measured with the file in the page cache.
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <job_file> [runs]\n", argv[0]);
+    return 1;
+  }
+  int runs = argc > 2 ? atoi(argv[2]) : 3;
+
+  int fd = open(argv[1], O_RDONLY);
+  struct stat job;
+  if (fd < 0 || fstat(fd, &job) != 0) {
+    fprintf(stderr, "Failed to open job file: %s\n", argv[1]);
+    return 1;
+  }
+
+  double best = 0;
+  size_t parsed = 0;
+  for (int i = 0; i < runs; i++) {
+    struct timespec start, end;
+    lseek(fd, 0, SEEK_SET);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    parsed = parse_job(fd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    if (i == 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+  close(fd);
+
+  printf("%s: %zu parsed, %.0f MB/s\n", argv[0], parsed,
+         (double)job.st_size / 1e6 / best);
+  return 0;
+}
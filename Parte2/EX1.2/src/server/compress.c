@@ -0,0 +1,261 @@
+#include "compress.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../common/io.h"
+
+#define MIN_MATCH 4
+// The format requires the last 5 bytes to be literals and the last match to
+// start at least 12 bytes before the end of the block
+#define LAST_LITERALS 5
+#define MATCH_FIND_LIMIT 12
+#define MAX_DISTANCE 65535
+#define HASH_LOG 12
+
+static uint32_t read32(const char *ptr) {
+  uint32_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+static uint32_t hash4(uint32_t sequence) {
+  return (sequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+// Writes a length that did not fit in its 4 bit token field.
+static char *write_length(char *out, size_t length) {
+  while (length >= 255) {
+    *out++ = (char)255;
+    length -= 255;
+  }
+  *out++ = (char)length;
+  return out;
+}
+
+// Writes a sequence: token, literals and, if match_length > 0, the match.
+static char *write_sequence(char *out, const char *literals,
+                            size_t literal_length, size_t offset,
+                            size_t match_length) {
+  char *token = out++;
+  unsigned char high = literal_length >= 15 ? 15 : (unsigned char)literal_length;
+  if (literal_length >= 15) {
+    out = write_length(out, literal_length - 15);
+  }
+  memcpy(out, literals, literal_length);
+  out += literal_length;
+
+  unsigned char low = 0;
+  if (match_length > 0) {
+    *out++ = (char)(offset & 0xff);
+    *out++ = (char)(offset >> 8);
+    size_t extra = match_length - MIN_MATCH;
+    low = extra >= 15 ? 15 : (unsigned char)extra;
+    if (extra >= 15) {
+      out = write_length(out, extra - 15);
+    }
+  }
+
+  *token = (char)((high << 4) | low);
+  return out;
+}
+
+size_t compress_block(const char *src, size_t src_size, char *dst) {
+  uint32_t table[1 << HASH_LOG];
+  memset(table, 0, sizeof(table));
+
+  const char *anchor = src;
+  char *out = dst;
+
+  if (src_size >= MATCH_FIND_LIMIT + 1) {
+    const char *match_limit = src + src_size - MATCH_FIND_LIMIT;
+    const char *end_limit = src + src_size - LAST_LITERALS;
+    // position 0 is never a valid candidate, so start searching at 1
+    const char *ip = src + 1;
+
+    while (ip < match_limit) {
+      uint32_t sequence = read32(ip);
+      uint32_t h = hash4(sequence);
+      const char *candidate = src + table[h];
+      table[h] = (uint32_t)(ip - src);
+
+      if (candidate == src || ip - candidate > MAX_DISTANCE ||
+          read32(candidate) != sequence) {
+        ip++;
+        continue;
+      }
+
+      size_t match_length = MIN_MATCH;
+      while (ip + match_length < end_limit &&
+             ip[match_length] == candidate[match_length]) {
+        match_length++;
+      }
+
+      out = write_sequence(out, anchor, (size_t)(ip - anchor),
+                           (size_t)(ip - candidate), match_length);
+      ip += match_length;
+      anchor = ip;
+    }
+  }
+
+  return (size_t)(write_sequence(out, anchor,
+                                 (size_t)(src + src_size - anchor), 0, 0) -
+                  dst);
+}
+
+// Reads a length that did not fit in its 4 bit token field.
+static int read_length(const unsigned char **in, const unsigned char *end,
+                       size_t *length) {
+  unsigned char byte;
+  do {
+    if (*in >= end) {
+      return -1;
+    }
+    byte = *(*in)++;
+    *length += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+long decompress_block(const char *src, size_t src_size, char *dst,
+                      size_t dst_size) {
+  const unsigned char *in = (const unsigned char *)src;
+  const unsigned char *in_end = in + src_size;
+  char *out = dst;
+  char *out_end = dst + dst_size;
+
+  while (in < in_end) {
+    unsigned char token = *in++;
+
+    size_t literal_length = token >> 4;
+    if (literal_length == 15 && read_length(&in, in_end, &literal_length)) {
+      return -1;
+    }
+    if ((size_t)(in_end - in) < literal_length ||
+        (size_t)(out_end - out) < literal_length) {
+      return -1;
+    }
+    memcpy(out, in, literal_length);
+    in += literal_length;
+    out += literal_length;
+
+    // the last sequence has no match
+    if (in == in_end) {
+      break;
+    }
+
+    if (in_end - in < 2) {
+      return -1;
+    }
+    size_t offset = (size_t)in[0] | ((size_t)in[1] << 8);
+    in += 2;
+    if (offset == 0 || offset > (size_t)(out - dst)) {
+      return -1;
+    }
+
+    size_t match_length = token & 0x0f;
+    if (match_length == 15 && read_length(&in, in_end, &match_length)) {
+      return -1;
+    }
+    match_length += MIN_MATCH;
+    if ((size_t)(out_end - out) < match_length) {
+      return -1;
+    }
+
+    // byte by byte, since the match may overlap what is being written
+    const char *match = out - offset;
+    for (size_t i = 0; i < match_length; i++) {
+      out[i] = match[i];
+    }
+    out += match_length;
+  }
+
+  return (long)(out - dst);
+}
+
+// Reads a 32 bit little endian value.
+static size_t load32(const unsigned char *src) {
+  return (size_t)src[0] | ((size_t)src[1] << 8) | ((size_t)src[2] << 16) |
+         ((size_t)src[3] << 24);
+}
+
+int decompress_stream(int in_fd, int out_fd) {
+  char magic[COMPRESS_MAGIC_SIZE];
+  size_t magic_read = 0;
+  ssize_t n = 0;
+  while (magic_read < COMPRESS_MAGIC_SIZE &&
+         (n = read(in_fd, magic + magic_read,
+                   COMPRESS_MAGIC_SIZE - magic_read)) > 0) {
+    magic_read += (size_t)n;
+  }
+  if (n < 0) {
+    return 1;
+  }
+
+  if (magic_read < COMPRESS_MAGIC_SIZE ||
+      memcmp(magic, COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE) != 0) {
+    // plain text backup: copy it as is
+    if (magic_read > 0 && write_all(out_fd, magic, magic_read) < 0) {
+      return 1;
+    }
+    char buf[4096];
+    while ((n = read(in_fd, buf, sizeof(buf))) > 0) {
+      if (write_all(out_fd, buf, (size_t)n) < 0) {
+        return 1;
+      }
+    }
+    return n < 0;
+  }
+
+  char *stored = NULL;
+  char *raw = NULL;
+  int result;
+  unsigned char header[COMPRESS_HEADER_SIZE];
+  while ((result = read_all(in_fd, header, COMPRESS_HEADER_SIZE, NULL)) > 0) {
+    size_t raw_size = load32(header);
+    size_t stored_size = load32(header + 4);
+    if (stored_size > raw_size) {
+      result = -1;
+      break;
+    }
+
+    char *new_stored = realloc(stored, stored_size + 1);
+    char *new_raw = realloc(raw, raw_size + 1);
+    if (new_stored != NULL) {
+      stored = new_stored;
+    }
+    if (new_raw != NULL) {
+      raw = new_raw;
+    }
+    if (new_stored == NULL || new_raw == NULL ||
+        read_all(in_fd, stored, stored_size, NULL) != 1) {
+      result = -1;
+      break;
+    }
+
+    const char *block = stored;
+    if (stored_size < raw_size) {
+      if (decompress_block(stored, stored_size, raw, raw_size) !=
+          (long)raw_size) {
+        result = -1;
+        break;
+      }
+      block = raw;
+    }
+    if (write_all(out_fd, block, raw_size) < 0) {
+      result = -1;
+      break;
+    }
+  }
+
+  free(stored);
+  free(raw);
+  if (result < 0) {
+    fprintf(stderr, "Corrupted compressed backup\n");
+    return 1;
+  }
+  return 0;
+}
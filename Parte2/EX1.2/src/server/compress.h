@@ -0,0 +1,41 @@
+#ifndef SERVER_COMPRESS_H
+#define SERVER_COMPRESS_H
+
+#include <stddef.h>
+
+/// Maximum size of a compressed block for an input of n bytes.
+#define COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+/// Magic number at the start of every compressed backup file.
+#define COMPRESS_MAGIC "KVSZ"
+#define COMPRESS_MAGIC_SIZE 4
+
+/// Size of the header before each block: raw size and stored size, both
+/// 32 bit little endian. When both sizes match the block is stored as is.
+#define COMPRESS_HEADER_SIZE 8
+
+/// Compresses a block using the LZ4 block format. Uses no heap memory and
+/// only async signal safe functions.
+/// @param src Data to compress.
+/// @param src_size Number of bytes in src.
+/// @param dst Output, with at least COMPRESS_BOUND(src_size) bytes.
+/// @return Number of bytes written to dst.
+size_t compress_block(const char *src, size_t src_size, char *dst);
+
+/// Decompresses a block created by compress_block.
+/// @param src Compressed data.
+/// @param src_size Number of bytes in src.
+/// @param dst Output buffer.
+/// @param dst_size Size of dst, which must fit the whole decompressed block.
+/// @return Number of bytes written to dst, or -1 if the block is corrupted.
+long decompress_block(const char *src, size_t src_size, char *dst,
+                      size_t dst_size);
+
+/// Copies a backup file to out_fd as plain text, decompressing it if it
+/// starts with COMPRESS_MAGIC. Plain backups are copied unchanged.
+/// @param in_fd Backup file to read from.
+/// @param out_fd File descriptor to write the pairs to.
+/// @return 0 if successful, 1 otherwise.
+int decompress_stream(int in_fd, int out_fd);
+
+#endif  // SERVER_COMPRESS_H
@@ -1,3 +1,54 @@
 #define MAX_WRITE_SIZE 256
 #define MAX_STRING_SIZE 40
 #define MAX_JOB_FILE_NAME_SIZE 256
+#define BACKUP_BUFFER_SIZE (1024 * 1024)
+#define BACKUP_WRITERS 4
+#define BACKUP_PARALLEL_MIN_SIZE (4 * BACKUP_BUFFER_SIZE)
+// Set to 1 (make BACKUP_COMPRESSION=1) to write LZ4 compressed backups
+#ifndef BACKUP_COMPRESSION
+#define BACKUP_COMPRESSION 0
+#endif
+#define PARSER_BUFFER_SIZE (64 * 1024)
+// Set to 0 (make COMPILED_JOBS=0) to always parse .job files, even when an up
+// to date .jobc (see kvsc) is next to them
+#ifndef COMPILED_JOBS
+#define COMPILED_JOBS 1
+#endif
+// WRITE, READ and DELETE commands with more than MAX_WRITE_SIZE pairs or keys
+// are applied in chunks. Set to 0 (make ATOMIC_COMMANDS=0) to apply each chunk
+// on its own, instead of the whole command under a single lock
+#ifndef ATOMIC_COMMANDS
+#define ATOMIC_COMMANDS 1
+#endif
+// Set to 1 (make PARALLEL_COMMANDS=1) to apply at the same time the commands
+// of a job that have no key in common, with up to PARALLEL_WORKERS threads
+#ifndef PARALLEL_COMMANDS
+#define PARALLEL_COMMANDS 0
+#endif
+#define PARALLEL_WORKERS 4
+// Set to 1 (make WATCH_JOBS=1) to keep watching the jobs directory with
+// inotify and run each job written into it, instead of stopping once the jobs
+// found at start are done
+#ifndef WATCH_JOBS
+#define WATCH_JOBS 0
+#endif
+// Set to 1 (make RECURSIVE_JOBS=1) to also run the jobs in subdirectories of
+// the jobs directory
+#ifndef RECURSIVE_JOBS
+#define RECURSIVE_JOBS 0
+#endif
+// Commands a job's parser may get ahead of its execution, which also bounds
+// how many can be applied in parallel
+#if PARALLEL_COMMANDS
+#define PIPELINE_DEPTH 64
+#else
+#define PIPELINE_DEPTH 8
+#endif
+// Threads opening the pipes of new sessions, which blocks until their clients
+// open them too
+#define CONNECT_THREADS 2
+// Bytes read from the register pipe at once, as many as it holds by default:
+// every connect request waiting in it is then taken with a single read
+#define REGISTER_BUFFER_SIZE 65536
+// Threads serving the requests of every session, at most one per online CPU
+#define SESSION_THREADS 4
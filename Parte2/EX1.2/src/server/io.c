@@ -1,8 +1,13 @@
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "compress.h"
+#include "io.h"
+
 void write_str(int fd, const char *str) {
   size_t len = strlen(str);
   const char *ptr = str;
@@ -43,3 +48,122 @@ size_t strn_memcpy(char *dest, const char *src, size_t n) {
   memcpy(dest, src, bytes_to_copy);
   return bytes_to_copy;
 }
+
+// Writes every iovec entirely, resuming after partial writes.
+// @param fd File descriptor to write to.
+// @param iov Array of buffers, modified while writing.
+// @param iovcnt Number of buffers.
+// @return 0 if successful, -1 otherwise.
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t written = writev(fd, iov, iovcnt);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    size_t left = (size_t)written;
+    while (iovcnt > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + left;
+      iov->iov_len -= left;
+    }
+  }
+  return 0;
+}
+
+// Stores a 32 bit value in little endian.
+static void store32(char *dest, size_t value) {
+  for (int i = 0; i < 4; i++) {
+    dest[i] = (char)((value >> (8 * i)) & 0xff);
+  }
+}
+
+// Copies data into the buffer, flushing it every time it fills up.
+static int buffer_append(write_buffer_t *wb, const char *data, size_t len) {
+  while (len > 0) {
+    size_t chunk = wb->size - wb->used;
+    if (chunk > len) {
+      chunk = len;
+    }
+    memcpy(wb->data + wb->used, data, chunk);
+    wb->used += chunk;
+    data += chunk;
+    len -= chunk;
+
+    if (wb->used == wb->size && buffer_flush(wb) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int buffer_write_pair(write_buffer_t *wb, const char *key, const char *value) {
+  size_t key_len = strlen(key);
+  size_t value_len = strlen(value);
+  size_t total = key_len + value_len + 5; // "(" + ", " + ")\n"
+
+  if (wb->size - wb->used >= total) {
+    char *ptr = wb->data + wb->used;
+    *ptr++ = '(';
+    memcpy(ptr, key, key_len);
+    ptr += key_len;
+    *ptr++ = ',';
+    *ptr++ = ' ';
+    memcpy(ptr, value, value_len);
+    ptr += value_len;
+    *ptr++ = ')';
+    *ptr++ = '\n';
+    wb->used += total;
+    return 0;
+  }
+
+  if (wb->compressed != NULL) {
+    // Blocks are compressed from the buffer, so the tuple has to go through it
+    if (buffer_append(wb, "(", 1) || buffer_append(wb, key, key_len) ||
+        buffer_append(wb, ", ", 2) || buffer_append(wb, value, value_len) ||
+        buffer_append(wb, ")\n", 2)) {
+      return -1;
+    }
+    return 0;
+  }
+
+  // The tuple does not fit: send it straight from the node together with
+  // whatever is pending, so long values are never truncated
+  struct iovec iov[6] = {
+      {wb->data, wb->used},         {"(", 1},
+      {(void *)key, key_len},       {", ", 2},
+      {(void *)value, value_len},   {")\n", 2},
+  };
+  wb->used = 0;
+  return writev_all(wb->fd, iov, 6);
+}
+
+int buffer_flush(write_buffer_t *wb) {
+  if (wb->compressed == NULL || wb->used == 0) {
+    struct iovec iov = {wb->data, wb->used};
+    wb->used = 0;
+    return writev_all(wb->fd, &iov, 1);
+  }
+
+  char header[COMPRESS_HEADER_SIZE];
+  size_t stored = compress_block(wb->data, wb->used, wb->compressed);
+  struct iovec iov[2] = {{header, COMPRESS_HEADER_SIZE},
+                         {wb->compressed, stored}};
+  if (stored >= wb->used) {
+    // not worth it, store the block as is
+    stored = wb->used;
+    iov[1].iov_base = wb->data;
+    iov[1].iov_len = stored;
+  }
+  store32(header, wb->used);
+  store32(header + 4, stored);
+  wb->used = 0;
+  return writev_all(wb->fd, iov, 2);
+}
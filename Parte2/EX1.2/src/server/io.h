@@ -3,6 +3,19 @@
 
 #include <unistd.h>
 
+/// Output buffer used by the backup process. Every function that touches it
+/// is async signal safe, so it can be used in a child created by fork() in a
+/// multi thread context.
+/// When compressed is not NULL, each flush writes one compressed block (see
+/// compress.h) and compressed must hold COMPRESS_BOUND(size) bytes.
+typedef struct {
+  int fd;
+  char *data;
+  size_t size;
+  size_t used;
+  char *compressed;
+} write_buffer_t;
+
 /// Writes a string to the given file descriptor.
 /// @param fd The file descriptor to write to.
 /// @param str The string to write.
@@ -20,4 +33,17 @@ void write_uint(int fd, int value);
 /// @return Number of bytes copied
 size_t strn_memcpy(char *dest, const char *src, size_t n);
 
+/// Appends a "(key, value)\n" tuple to the buffer. The buffer is only
+/// flushed, together with the tuple, when the tuple does not fit.
+/// @param wb Buffer to write to.
+/// @param key The key.
+/// @param value The value.
+/// @return 0 if successful, -1 otherwise.
+int buffer_write_pair(write_buffer_t *wb, const char *key, const char *value);
+
+/// Writes everything pending in the buffer to its file descriptor.
+/// @param wb Buffer to flush.
+/// @return 0 if successful, -1 otherwise.
+int buffer_flush(write_buffer_t *wb);
+
 #endif // KVS_IO_H
@@ -0,0 +1,241 @@
+#include "jobc.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../common/io.h"
+
+static void store32(unsigned char *dst, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    dst[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+static void store64(unsigned char *dst, int64_t value) {
+  for (int i = 0; i < 8; i++) {
+    dst[i] = (unsigned char)((uint64_t)value >> (8 * i));
+  }
+}
+
+static uint32_t load32(const unsigned char *src) {
+  return (uint32_t)src[0] | ((uint32_t)src[1] << 8) |
+         ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+// Stores a string as its length, its bytes and a '\0'.
+// @return Pointer past the stored string.
+static unsigned char *store_string(unsigned char *dst, const char *str) {
+  size_t len = strlen(str);
+  dst[0] = (unsigned char)len;
+  memcpy(dst + 1, str, len + 1);
+  return dst + len + 2;
+}
+
+void jobc_header(char *header, const struct stat *source) {
+  unsigned char *dst = (unsigned char *)header;
+  memcpy(dst, JOBC_MAGIC, 4);
+  store32(dst + 4, JOBC_VERSION);
+  store64(dst + 8, (int64_t)source->st_size);
+  store64(dst + 16, (int64_t)source->st_mtim.tv_sec);
+  store64(dst + 24, (int64_t)source->st_mtim.tv_nsec);
+}
+
+size_t jobc_encode(const job_command_t *command, char *record) {
+  unsigned char *start = (unsigned char *)record;
+  unsigned char *dst = start + JOBC_RECORD_HEADER_SIZE;
+
+  switch (command->cmd) {
+  case CMD_WRITE:
+  case CMD_READ:
+  case CMD_DELETE:
+    dst[0] = (unsigned char)command->num_pairs;
+    dst[1] = (unsigned char)(command->num_pairs >> 8);
+    dst += 2;
+    for (size_t i = 0; i < command->num_pairs; i++) {
+      dst = store_string(dst, command->keys[i]);
+      if (command->cmd == CMD_WRITE) {
+        dst = store_string(dst, command->values[i]);
+      }
+    }
+    break;
+
+  case CMD_WAIT:
+    store32(dst, command->delay);
+    dst += 4;
+    break;
+
+  case CMD_EMPTY:
+  case EOC:
+    return 0;
+
+  case CMD_SHOW:
+  case CMD_BACKUP:
+  case CMD_HELP:
+  case CMD_INVALID:
+    break;
+  }
+
+  size_t size = (size_t)(dst - start);
+  store32(start, (uint32_t)(size - JOBC_RECORD_HEADER_SIZE));
+  start[4] = (unsigned char)command->cmd;
+  start[5] = 0;
+  if (command->cmd == CMD_WRITE || command->cmd == CMD_READ ||
+      command->cmd == CMD_DELETE) {
+    start[5] = (unsigned char)((command->continued ? JOBC_CONTINUED : 0) |
+                               (command->more ? JOBC_MORE : 0) |
+                               (command->aborted ? JOBC_ABORTED : 0));
+  }
+  return size;
+}
+
+// Points a command's keys and values at the strings in its payload.
+// @return 0 if the strings fit the payload, 1 otherwise.
+static int link_strings(job_command_t *command, const char *payload,
+                        size_t payload_size) {
+  size_t strings = command->cmd == CMD_WRITE ? 2 : 1;
+  size_t pos = 0;
+  for (size_t i = 0; i < command->num_pairs; i++) {
+    for (size_t j = 0; j < strings; j++) {
+      if (pos >= payload_size) {
+        return 1;
+      }
+      size_t len = (unsigned char)payload[pos];
+      if (len >= MAX_STRING_SIZE || pos + len + 2 > payload_size ||
+          payload[pos + len + 1] != '\0') {
+        return 1;
+      }
+      if (j == 0) {
+        command->keys[i] = payload + pos + 1;
+      } else {
+        command->values[i] = payload + pos + 1;
+      }
+      pos += len + 2;
+    }
+  }
+  return pos != payload_size;
+}
+
+// Decodes the next record of a compiled job, whatever came before it.
+// @return 0 if no errors, 1 if the file is corrupted (command is then EOC).
+static int decode_record(job_reader_t *reader, job_command_t *command) {
+  unsigned char header[JOBC_RECORD_HEADER_SIZE];
+  size_t header_read = job_reader_read(reader, header, sizeof(header));
+  command->cmd = EOC;
+  if (header_read == 0) {
+    return 0;
+  }
+  if (header_read != sizeof(header) || header[4] >= EOC) {
+    return 1;
+  }
+
+  size_t payload_size = load32(header);
+  enum Command cmd = (enum Command)header[4];
+  command->continued = (header[5] & JOBC_CONTINUED) != 0;
+  command->more = (header[5] & JOBC_MORE) != 0;
+  command->aborted = (header[5] & JOBC_ABORTED) != 0;
+  unsigned char count[4];
+  const char *payload;
+  switch (cmd) {
+  case CMD_WRITE:
+  case CMD_READ:
+  case CMD_DELETE:
+    if (payload_size < 2 ||
+        payload_size > JOBC_RECORD_MAX_SIZE - JOBC_RECORD_HEADER_SIZE ||
+        job_reader_read(reader, count, 2) != 2 ||
+        (payload = job_reader_slice(reader, payload_size - 2)) == NULL) {
+      return 1;
+    }
+    command->cmd = cmd;
+    command->num_pairs = (size_t)count[0] | ((size_t)count[1] << 8);
+    if ((command->num_pairs == 0) != command->aborted ||
+        command->num_pairs > MAX_WRITE_SIZE ||
+        link_strings(command, payload, payload_size - 2)) {
+      command->cmd = EOC;
+      return 1;
+    }
+    return 0;
+
+  case CMD_WAIT:
+    if (payload_size != 4 || job_reader_read(reader, count, 4) != 4) {
+      return 1;
+    }
+    command->cmd = cmd;
+    command->delay = load32(count);
+    return 0;
+
+  case CMD_SHOW:
+  case CMD_BACKUP:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    if (payload_size != 0) {
+      return 1;
+    }
+    command->cmd = cmd;
+    return 0;
+  }
+  return 1;
+}
+
+int jobc_decode(job_reader_t *reader, job_command_t *command, int *more,
+                enum Command *partial) {
+  int corrupted = decode_record(reader, command);
+  int chunk = command->cmd == CMD_WRITE || command->cmd == CMD_READ ||
+              command->cmd == CMD_DELETE;
+  // Chunks come in order, the first not continued and the last not more
+  if (!corrupted &&
+      (*more ? !chunk || command->cmd != *partial || !command->continued
+             : chunk && command->continued)) {
+    corrupted = 1;
+  }
+  if (corrupted && *more) {
+    // The chunks already decoded still need an end, as a command whose next
+    // chunk did not parse (see pipeline.c), or the table would stay locked
+    // for them (ATOMIC_COMMANDS)
+    command->cmd = *partial;
+    command->num_pairs = 0;
+    command->continued = 1;
+    command->more = 0;
+    command->aborted = 1;
+  } else if (corrupted) {
+    command->cmd = EOC;
+  } else if (chunk) {
+    *partial = command->cmd;
+  }
+  *more = !corrupted && chunk && command->more;
+  return corrupted;
+}
+
+int jobc_open(const char *job_path, int job_fd) {
+  struct stat source;
+  if (fstat(job_fd, &source) != 0) {
+    return -1;
+  }
+
+  char path[MAX_JOB_FILE_NAME_SIZE + 1];
+  size_t len = strlen(job_path);
+  if (len + 2 > sizeof(path)) {
+    return -1;
+  }
+  memcpy(path, job_path, len);
+  path[len] = 'c';
+  path[len + 1] = '\0';
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  char expected[JOBC_HEADER_SIZE];
+  char header[JOBC_HEADER_SIZE];
+  jobc_header(expected, &source);
+  if (read_all(fd, header, JOBC_HEADER_SIZE, NULL) != 1 ||
+      memcmp(header, expected, JOBC_HEADER_SIZE) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
@@ -0,0 +1,63 @@
+#ifndef SERVER_JOBC_H
+#define SERVER_JOBC_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "constants.h"
+#include "parser.h"
+#include "pipeline.h"
+
+// A compiled job (.jobc) is a header followed by a record per command (or
+// chunk of one):
+//   header: "KVSJ", version (u32), size, mtime seconds and mtime nanoseconds
+//           of the .job it was compiled from (i64 each)
+//   record: payload length (u32), command (u8), chunk flags (u8), payload
+// WRITE, READ and DELETE payloads are the number of pairs or keys (u16) and
+// then each string as its length (u8), its bytes and a '\0'. Their chunk
+// flags are JOBC_CONTINUED, JOBC_MORE and JOBC_ABORTED (see job_command_t),
+// other commands have none. A WAIT payload is the delay (u32), other commands
+// have no payload. Empty lines are not stored and the end of the file is the
+// end of the job. Integers are little-endian.
+#define JOBC_MAGIC "KVSJ"
+#define JOBC_VERSION 2
+#define JOBC_HEADER_SIZE 32
+#define JOBC_RECORD_HEADER_SIZE 6
+#define JOBC_CONTINUED 1
+#define JOBC_MORE 2
+#define JOBC_ABORTED 4
+#define JOBC_RECORD_MAX_SIZE                                                   \
+  (JOBC_RECORD_HEADER_SIZE + 2 + 2 * MAX_WRITE_SIZE * (MAX_STRING_SIZE + 1))
+
+/// Fills in the header of a compiled job.
+/// @param header Buffer of JOBC_HEADER_SIZE bytes.
+/// @param source Status of the .job being compiled.
+void jobc_header(char *header, const struct stat *source);
+
+/// Encodes a parsed command as a record.
+/// @param command Command to encode.
+/// @param record Buffer of JOBC_RECORD_MAX_SIZE bytes.
+/// @return Size of the record, 0 if the command is not stored.
+size_t jobc_encode(const job_command_t *command, char *record);
+
+/// Decodes the next record of a compiled job, without tokenizing anything.
+/// The command's keys and values point into the reader's buffer, as parsed
+/// strings do (see parse_write).
+/// @param reader Reader of the compiled job, past its header.
+/// @param command Where to store the command. EOC at the end of the job.
+/// @param more Whether the last record decoded has more chunks, 0 at first.
+/// @param partial Command of the last chunk decoded.
+/// @return 0 if no errors, 1 if the file is corrupted: command is then EOC,
+/// or an aborted last chunk if one is due, and nothing more is to be decoded.
+int jobc_decode(job_reader_t *reader, job_command_t *command, int *more,
+                enum Command *partial);
+
+/// Opens the compiled version of a job, if there is one compiled from the job
+/// as it is now.
+/// @param job_path Path of the .job.
+/// @param job_fd File descriptor of the .job.
+/// @return File descriptor of the .jobc, positioned after its header, or -1 if
+/// there is no up to date one.
+int jobc_open(const char *job_path, int job_fd);
+
+#endif  // SERVER_JOBC_H
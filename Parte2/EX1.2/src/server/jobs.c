@@ -0,0 +1,566 @@
+#include "jobs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+
+// The jobs of a worker, in a ring: the worker takes from the front, the
+// largest, and other workers steal from the back, the smallest. The jobs
+// listed by jobs_init are dealt to the deques round-robin, largest first, so
+// each is sorted too; the ones added later go to the back of the shortest.
+typedef struct {
+  pthread_mutex_t mutex;
+  char **paths;
+  size_t capacity;
+  size_t head;
+  size_t count;
+} deque_t;
+
+typedef struct {
+  char *path;
+  off_t size;
+} job_t;
+
+// Jobs found in a directory, not dealt yet.
+typedef struct {
+  job_t *jobs;
+  size_t count;
+  size_t capacity;
+} job_list_t;
+
+// A job waiting on a WAIT.
+typedef struct {
+  struct timespec until; // CLOCK_MONOTONIC
+  void *job;
+} suspended_t;
+
+// A directory watched for new jobs (WATCH_JOBS).
+typedef struct {
+  int wd;
+  char *path;
+} watched_t;
+
+static struct {
+  const char *dir_name;
+  int (*filter)(const char *);
+  deque_t *deques;
+  size_t workers;
+  pthread_mutex_t mutex; // the fields below
+  pthread_cond_t changed; // a job was added, suspended or finished
+  unsigned long added;    // times jobs were added after jobs_init
+  suspended_t *suspended; // heap, the one to resume first at the root
+  size_t num_suspended;
+  size_t max_suspended;
+  size_t running;         // jobs taken and not finished, suspended or not
+} jobs = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+// Only used by the watcher thread once it is started.
+static struct {
+  int fd; // inotify instance, -1 if not watching
+  int stop[2]; // pipe written by jobs_destroy to stop the watcher
+  pthread_t thread;
+  watched_t *dirs;
+  size_t num_dirs;
+  size_t max_dirs;
+} watcher = {.fd = -1, .stop = {-1, -1}};
+
+// Largest first, by path among jobs of the same size.
+static int compare_jobs(const void *a, const void *b) {
+  const job_t *job_a = a, *job_b = b;
+  if (job_a->size != job_b->size) {
+    return job_a->size > job_b->size ? -1 : 1;
+  }
+  return strcmp(job_a->path, job_b->path);
+}
+
+// Joins a path and a name in it.
+// @param dir Path, "" for none.
+// @return The joined path, to be freed, or NULL if out of memory.
+static char *join_path(const char *dir, const char *name) {
+  size_t size = strlen(dir) + strlen(name) + 2;
+  char *path = malloc(size);
+  if (path != NULL) {
+    snprintf(path, size, "%s%s%s", dir, dir[0] != '\0' ? "/" : "", name);
+  }
+  return path;
+}
+
+// Gets the size of a job, 0 if it can not be found (it then fails when it is
+// opened, as it did before being sorted).
+static off_t job_size(const char *path) {
+  char *full = join_path(jobs.dir_name, path);
+  struct stat status;
+  off_t size = full != NULL && stat(full, &status) == 0 ? status.st_size : 0;
+  free(full);
+  return size;
+}
+
+// Adds a job to a list, taking its path.
+// @return 0 if no errors, 1 otherwise (the path is then freed)
+static int list_job(job_list_t *list, char *path) {
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity > 0 ? 2 * list->capacity : 16;
+    job_t *grown = realloc(list->jobs, capacity * sizeof(job_t));
+    if (grown == NULL) {
+      free(path);
+      return 1;
+    }
+    list->jobs = grown;
+    list->capacity = capacity;
+  }
+  list->jobs[list->count++] = (job_t){path, job_size(path)};
+  return 0;
+}
+
+// Watches a directory for jobs closed after being written or moved in, and
+// with RECURSIVE_JOBS for subdirectories created or moved in.
+// @param path Path relative to the jobs directory, "" for the directory itself.
+static void watch_dir(const char *path) {
+  char *full = path[0] != '\0' ? join_path(jobs.dir_name, path)
+                               : strdup(jobs.dir_name);
+  char *copy = strdup(path);
+  uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR;
+  if (RECURSIVE_JOBS) {
+    mask |= IN_CREATE;
+  }
+  int wd = full != NULL ? inotify_add_watch(watcher.fd, full, mask) : -1;
+
+  if (wd >= 0 && copy != NULL && watcher.num_dirs == watcher.max_dirs) {
+    size_t max_dirs = watcher.max_dirs > 0 ? 2 * watcher.max_dirs : 16;
+    watched_t *grown = realloc(watcher.dirs, max_dirs * sizeof(watched_t));
+    if (grown != NULL) {
+      watcher.dirs = grown;
+      watcher.max_dirs = max_dirs;
+    }
+  }
+  if (wd < 0 || copy == NULL || watcher.num_dirs == watcher.max_dirs) {
+    fprintf(stderr, "Failed to watch directory: %s\n",
+            full != NULL ? full : path);
+    free(copy);
+  } else {
+    // Watching a directory again gives the same wd
+    size_t i = 0;
+    while (i < watcher.num_dirs && watcher.dirs[i].wd != wd) {
+      i++;
+    }
+    if (i < watcher.num_dirs) {
+      free(watcher.dirs[i].path);
+    } else {
+      watcher.num_dirs++;
+    }
+    watcher.dirs[i] = (watched_t){wd, copy};
+  }
+  free(full);
+}
+
+// Lists the jobs of a directory and, with RECURSIVE_JOBS, of its
+// subdirectories. With WATCH_JOBS, each directory is watched before it is
+// listed, so no job written meanwhile is missed.
+// @param path Path relative to the jobs directory, "" for the directory itself.
+// @param list Where to add the jobs found, by path relative to the jobs
+// directory.
+// @return 0 if the directory could be listed, 1 otherwise
+static int scan_dir(const char *path, job_list_t *list) {
+  if (WATCH_JOBS) {
+    watch_dir(path);
+  }
+  char *full = path[0] != '\0' ? join_path(jobs.dir_name, path)
+                               : strdup(jobs.dir_name);
+  DIR *dir = full != NULL ? opendir(full) : NULL;
+  if (dir == NULL) {
+    free(full);
+    return 1;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    char *entry_path = join_path(path, entry->d_name);
+    if (entry_path == NULL) {
+      continue;
+    }
+    if (RECURSIVE_JOBS) {
+      // Links to directories are not followed, as they may loop
+      char *entry_full = join_path(full, entry->d_name);
+      struct stat status;
+      if (entry_full != NULL && lstat(entry_full, &status) == 0 &&
+          S_ISDIR(status.st_mode)) {
+        scan_dir(entry_path, list);
+        free(entry_full);
+        free(entry_path);
+        continue;
+      }
+      free(entry_full);
+    }
+    if (jobs.filter(entry->d_name)) {
+      list_job(list, entry_path);
+    } else {
+      free(entry_path);
+    }
+  }
+
+  closedir(dir);
+  free(full);
+  return 0;
+}
+
+// Adds a job to the back of a deque, taking its path.
+// @return 0 if no errors, 1 otherwise
+static int push_back(deque_t *deque, char *path) {
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->count == deque->capacity) {
+    size_t capacity = deque->capacity > 0 ? 2 * deque->capacity : 16;
+    char **paths = malloc(capacity * sizeof(char *));
+    if (paths == NULL) {
+      pthread_mutex_unlock(&deque->mutex);
+      return 1;
+    }
+    for (size_t i = 0; i < deque->count; i++) {
+      paths[i] = deque->paths[(deque->head + i) % deque->capacity];
+    }
+    free(deque->paths);
+    deque->paths = paths;
+    deque->capacity = capacity;
+    deque->head = 0;
+  }
+  deque->paths[(deque->head + deque->count++) % deque->capacity] = path;
+  pthread_mutex_unlock(&deque->mutex);
+  return 0;
+}
+
+// Adds the jobs of a list, largest first, each to the shortest deque, and
+// wakes up the workers waiting for one.
+static void add_jobs(job_list_t *list) {
+  if (list->count > 1) {
+    qsort(list->jobs, list->count, sizeof(job_t), compare_jobs);
+  }
+  for (size_t i = 0; i < list->count; i++) {
+    deque_t *shortest = NULL;
+    size_t shortest_count = SIZE_MAX;
+    for (size_t w = 0; w < jobs.workers; w++) {
+      pthread_mutex_lock(&jobs.deques[w].mutex);
+      if (jobs.deques[w].count < shortest_count) {
+        shortest = &jobs.deques[w];
+        shortest_count = jobs.deques[w].count;
+      }
+      pthread_mutex_unlock(&jobs.deques[w].mutex);
+    }
+    if (push_back(shortest, list->jobs[i].path)) {
+      fprintf(stderr, "Failed to add job: %s\n", list->jobs[i].path);
+      free(list->jobs[i].path);
+    }
+  }
+  list->count = 0;
+
+  pthread_mutex_lock(&jobs.mutex);
+  jobs.added++;
+  pthread_cond_broadcast(&jobs.changed);
+  pthread_mutex_unlock(&jobs.mutex);
+}
+
+// Adds the jobs written into the watched directories as they are closed,
+// until jobs_destroy.
+static void *watcher_thread(void *arg) {
+  (void)arg;
+  char buffer[16 * 1024]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds[2] = {{watcher.fd, POLLIN, 0},
+                          {watcher.stop[0], POLLIN, 0}};
+  job_list_t list = {NULL, 0, 0};
+
+  while (1) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to watch job directory: %s\n", jobs.dir_name);
+      break;
+    }
+    if (fds[1].revents != 0) {
+      break;
+    }
+    ssize_t size = read(watcher.fd, buffer, sizeof(buffer));
+    if (size <= 0) {
+      continue;
+    }
+
+    // Jobs closed together are added together, largest first
+    for (char *ptr = buffer; ptr < buffer + size;) {
+      const struct inotify_event *event = (const struct inotify_event *)ptr;
+      ptr += sizeof(struct inotify_event) + event->len;
+      if (event->mask & IN_Q_OVERFLOW) {
+        fprintf(stderr, "Too many new jobs, some may be missed\n");
+      }
+      if (event->len == 0) {
+        continue;
+      }
+      const char *dir = NULL;
+      for (size_t i = 0; i < watcher.num_dirs && dir == NULL; i++) {
+        if (watcher.dirs[i].wd == event->wd) {
+          dir = watcher.dirs[i].path;
+        }
+      }
+      char *path = dir != NULL ? join_path(dir, event->name) : NULL;
+      if (path == NULL) {
+        continue;
+      }
+
+      if (event->mask & IN_ISDIR) {
+        // Its jobs may have been written before it was watched
+        if (RECURSIVE_JOBS) {
+          scan_dir(path, &list);
+        }
+        free(path);
+      } else if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) &&
+                 jobs.filter(event->name)) {
+        list_job(&list, path);
+      } else {
+        free(path);
+      }
+    }
+    if (list.count > 0) {
+      add_jobs(&list);
+    }
+  }
+
+  free(list.jobs);
+  return NULL;
+}
+
+int jobs_init(const char *dir_name, int (*filter)(const char *),
+              size_t workers) {
+  jobs.dir_name = dir_name;
+  jobs.filter = filter;
+  jobs.workers = workers;
+
+  if (WATCH_JOBS && ((watcher.fd = inotify_init1(IN_CLOEXEC)) < 0 ||
+                     pipe(watcher.stop) != 0)) {
+    fprintf(stderr, "Failed to watch job directory: %s\n", dir_name);
+    return 1;
+  }
+
+  job_list_t list = {NULL, 0, 0};
+  if (scan_dir("", &list)) {
+    fprintf(stderr, "Failed to open directory: %s\n", dir_name);
+    return 1;
+  }
+  if (list.count > 1) {
+    qsort(list.jobs, list.count, sizeof(job_t), compare_jobs);
+  }
+
+  jobs.deques = calloc(workers, sizeof(deque_t));
+  // Each job is suspended at most once at a time, so this only grows when
+  // jobs are added
+  jobs.max_suspended = list.count + 1;
+  jobs.suspended = malloc(jobs.max_suspended * sizeof(suspended_t));
+  if (jobs.deques == NULL || jobs.suspended == NULL) {
+    fprintf(stderr, "Failed to allocate memory for jobs\n");
+    return 1;
+  }
+  for (size_t i = 0; i < workers; i++) {
+    pthread_mutex_init(&jobs.deques[i].mutex, NULL);
+  }
+  for (size_t i = 0; i < list.count; i++) {
+    if (push_back(&jobs.deques[i % workers], list.jobs[i].path)) {
+      fprintf(stderr, "Failed to allocate memory for jobs\n");
+      return 1;
+    }
+  }
+  free(list.jobs);
+
+  // Deadlines are monotonic, so a change of the clock does not move them
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&jobs.changed, &attr);
+  pthread_condattr_destroy(&attr);
+  jobs.added = 0;
+  jobs.num_suspended = 0;
+  jobs.running = 0;
+
+  if (WATCH_JOBS &&
+      pthread_create(&watcher.thread, NULL, watcher_thread, NULL) != 0) {
+    fprintf(stderr, "Failed to watch job directory: %s\n", dir_name);
+    return 1;
+  }
+  return 0;
+}
+
+static int before(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec < b->tv_sec ||
+         (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void swap_suspended(size_t i, size_t j) {
+  suspended_t aux = jobs.suspended[i];
+  jobs.suspended[i] = jobs.suspended[j];
+  jobs.suspended[j] = aux;
+}
+
+// Takes the suspended job to resume first.
+// Must be called with jobs.mutex locked, and some job suspended.
+static void *pop_suspended() {
+  void *job = jobs.suspended[0].job;
+  jobs.suspended[0] = jobs.suspended[--jobs.num_suspended];
+  size_t i = 0;
+  while (1) {
+    size_t first = i, left = 2 * i + 1, right = 2 * i + 2;
+    if (left < jobs.num_suspended &&
+        before(&jobs.suspended[left].until, &jobs.suspended[first].until)) {
+      first = left;
+    }
+    if (right < jobs.num_suspended &&
+        before(&jobs.suspended[right].until, &jobs.suspended[first].until)) {
+      first = right;
+    }
+    if (first == i) {
+      return job;
+    }
+    swap_suspended(i, first);
+    i = first;
+  }
+}
+
+// Takes the next job dealt to a worker, or steals one.
+static char *take_job(size_t worker) {
+  deque_t *deque = &jobs.deques[worker];
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->count > 0) {
+    char *path = deque->paths[deque->head];
+    deque->head = (deque->head + 1) % deque->capacity;
+    deque->count--;
+    pthread_mutex_unlock(&deque->mutex);
+    return path;
+  }
+  pthread_mutex_unlock(&deque->mutex);
+
+  for (size_t i = 1; i < jobs.workers; i++) {
+    deque = &jobs.deques[(worker + i) % jobs.workers];
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->count > 0) {
+      deque->count--;
+      char *path =
+          deque->paths[(deque->head + deque->count) % deque->capacity];
+      pthread_mutex_unlock(&deque->mutex);
+      return path;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+  }
+  return NULL;
+}
+
+char *jobs_next(size_t worker, void **resumed) {
+  *resumed = NULL;
+  pthread_mutex_lock(&jobs.mutex);
+  while (1) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (jobs.num_suspended > 0 && !before(&now, &jobs.suspended[0].until)) {
+      *resumed = pop_suspended();
+      pthread_mutex_unlock(&jobs.mutex);
+      return NULL;
+    }
+
+    // Running while it is taken, so that no worker stops meanwhile
+    jobs.running++;
+    unsigned long added = jobs.added;
+    pthread_mutex_unlock(&jobs.mutex);
+    char *path = take_job(worker);
+    if (path != NULL) {
+      return path;
+    }
+
+    pthread_mutex_lock(&jobs.mutex);
+    if (--jobs.running == 0 && !WATCH_JOBS) {
+      pthread_cond_broadcast(&jobs.changed);
+      pthread_mutex_unlock(&jobs.mutex);
+      return NULL;
+    }
+    if (jobs.added != added) {
+      continue; // added while it was taking one
+    }
+    // Others are still running, or suspended, and may be resumed here, or
+    // new jobs may be added while watching
+    if (jobs.num_suspended > 0) {
+      pthread_cond_timedwait(&jobs.changed, &jobs.mutex,
+                             &jobs.suspended[0].until);
+    } else {
+      pthread_cond_wait(&jobs.changed, &jobs.mutex);
+    }
+  }
+}
+
+int jobs_suspend(void *job, const struct timespec *until) {
+  pthread_mutex_lock(&jobs.mutex);
+  if (jobs.num_suspended == jobs.max_suspended) {
+    suspended_t *grown =
+        realloc(jobs.suspended, 2 * jobs.max_suspended * sizeof(suspended_t));
+    if (grown == NULL) {
+      pthread_mutex_unlock(&jobs.mutex);
+      return 1;
+    }
+    jobs.suspended = grown;
+    jobs.max_suspended *= 2;
+  }
+
+  size_t i = jobs.num_suspended++;
+  jobs.suspended[i] = (suspended_t){*until, job};
+  while (i > 0 && before(&jobs.suspended[i].until,
+                         &jobs.suspended[(i - 1) / 2].until)) {
+    swap_suspended(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  // Every waiting worker may have to wait less now
+  pthread_cond_broadcast(&jobs.changed);
+  pthread_mutex_unlock(&jobs.mutex);
+  return 0;
+}
+
+void jobs_finish() {
+  pthread_mutex_lock(&jobs.mutex);
+  if (--jobs.running == 0) {
+    pthread_cond_broadcast(&jobs.changed);
+  }
+  pthread_mutex_unlock(&jobs.mutex);
+}
+
+void jobs_destroy() {
+  if (watcher.fd >= 0) {
+    if (write(watcher.stop[1], "", 1) == 1) {
+      pthread_join(watcher.thread, NULL);
+    }
+    close(watcher.stop[0]);
+    close(watcher.stop[1]);
+    close(watcher.fd);
+    for (size_t i = 0; i < watcher.num_dirs; i++) {
+      free(watcher.dirs[i].path);
+    }
+    free(watcher.dirs);
+    watcher.fd = -1;
+  }
+
+  for (size_t i = 0; i < jobs.workers; i++) {
+    deque_t *deque = &jobs.deques[i];
+    for (size_t j = 0; j < deque->count; j++) {
+      free(deque->paths[(deque->head + j) % deque->capacity]);
+    }
+    free(deque->paths);
+    pthread_mutex_destroy(&deque->mutex);
+  }
+  free(jobs.deques);
+  free(jobs.suspended);
+  pthread_cond_destroy(&jobs.changed);
+}
@@ -0,0 +1,44 @@
+#ifndef SERVER_JOBS_H
+#define SERVER_JOBS_H
+
+#include <stddef.h>
+#include <time.h>
+
+/// @brief Lists the jobs of a directory, and with RECURSIVE_JOBS of its
+/// subdirectories, sorts them largest first and deals them in that order to a
+/// deque per worker. With WATCH_JOBS, the directories are watched from then
+/// on, and each job closed after being written, or moved, into one of them
+/// is added to the shortest deque as soon as it is.
+/// @param dir_name Directory of the jobs.
+/// @param filter Which file names are jobs.
+/// @param workers Number of workers taking jobs.
+/// @return 0 if no errors, 1 otherwise
+int jobs_init(const char *dir_name, int (*filter)(const char *),
+              size_t workers);
+
+/// @brief Takes the next job for a worker: a suspended job whose WAIT is
+/// over, else the largest job left in its own deque or, once that is empty,
+/// the smallest one left in another worker's. When there are none of those,
+/// but jobs are still running or suspended, or may still be added
+/// (WATCH_JOBS), waits for one.
+/// Every job taken must be finished with jobs_finish.
+/// @param worker Index of the worker, less than the number of workers.
+/// @param resumed Where to store the suspended job to resume, NULL if none.
+/// @return Path of a new job relative to the jobs directory, to be freed, or
+/// NULL if a job is resumed instead or there are no jobs left.
+char *jobs_next(size_t worker, void **resumed);
+
+/// @brief Puts a job aside until the end of a WAIT, so its worker can take
+/// other jobs meanwhile.
+/// @param job The job, which jobs_next gives back.
+/// @param until End of the WAIT, on CLOCK_MONOTONIC.
+/// @return 0 if no errors, 1 otherwise (the job is then not suspended)
+int jobs_suspend(void *job, const struct timespec *until);
+
+/// @brief Tells that a job taken with jobs_next is finished.
+void jobs_finish();
+
+/// @brief Stops watching the jobs directory and frees the jobs left.
+void jobs_destroy();
+
+#endif  // SERVER_JOBS_H
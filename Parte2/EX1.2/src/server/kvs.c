@@ -26,6 +26,7 @@ struct HashTable *create_hash_table() {
     return NULL;
   for (int i = 0; i < TABLE_SIZE; i++) {
     ht->table[i] = NULL;
+    pthread_rwlock_init(&ht->bucketlocks[i], NULL);
   }
   pthread_rwlock_init(&ht->tablelock, NULL);
   return ht;
@@ -118,6 +119,7 @@ void free_table(HashTable *ht) {
       free(temp->value);
       free(temp);
     }
+    pthread_rwlock_destroy(&ht->bucketlocks[i]);
   }
   pthread_rwlock_destroy(&ht->tablelock);
   free(ht);
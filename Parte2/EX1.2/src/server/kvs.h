@@ -14,6 +14,9 @@ typedef struct KeyNode {
 typedef struct HashTable {
   KeyNode *table[TABLE_SIZE];
   pthread_rwlock_t tablelock;
+  // Only taken by operations applied concurrently under tablelock (see
+  // kvs_apply_concurrent), which may share a bucket but not a key
+  pthread_rwlock_t bucketlocks[TABLE_SIZE];
 } HashTable;
 
 /// Creates a new KVS hash table.
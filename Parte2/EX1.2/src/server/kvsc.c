@@ -0,0 +1,112 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "jobc.h"
+#include "pipeline.h"
+
+// Compiles a job into a .jobc next to it. It is written to a temporary file
+// renamed over the .jobc once whole: its header alone makes it look up to
+// date, so the server must never find it half-written.
+// @param path Path of the .job.
+// @return 0 if no errors, 1 otherwise.
+static int compile(const char *path) {
+  char jobc_path[MAX_JOB_FILE_NAME_SIZE + 1];
+  if (strlen(path) + 2 > sizeof(jobc_path)) {
+    fprintf(stderr, "Job file name is too long: %s\n", path);
+    return 1;
+  }
+  strcpy(jobc_path, path);
+  strcat(jobc_path, "c");
+  char tmp_path[MAX_JOB_FILE_NAME_SIZE + 8];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", jobc_path);
+
+  int fd = open(path, O_RDONLY);
+  struct stat source;
+  if (fd < 0 || fstat(fd, &source) != 0) {
+    fprintf(stderr, "Failed to open job file: %s\n", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+
+  job_pipeline_t *pipeline = malloc(sizeof(job_pipeline_t));
+  char *record = malloc(JOBC_RECORD_MAX_SIZE);
+  // mkstemp creates it 0600: it gets what fopen would have given the .jobc
+  mode_t mask = umask(0);
+  umask(mask);
+  int out_fd = mkstemp(tmp_path);
+  FILE *out = out_fd >= 0 && fchmod(out_fd, 0666 & ~mask) == 0
+                  ? fdopen(out_fd, "wb")
+                  : NULL;
+  if (pipeline == NULL || record == NULL || out == NULL ||
+      pipeline_start(pipeline, fd, 0) != 0) {
+    fprintf(stderr, "Failed to compile job file: %s\n", path);
+    if (out != NULL) {
+      fclose(out);
+    } else if (out_fd >= 0) {
+      close(out_fd);
+    }
+    if (out_fd >= 0) {
+      unlink(tmp_path);
+    }
+    free(record);
+    free(pipeline);
+    close(fd);
+    return 1;
+  }
+
+  char header[JOBC_HEADER_SIZE];
+  jobc_header(header, &source);
+  int failed = fwrite(header, JOBC_HEADER_SIZE, 1, out) != 1;
+
+  int done = 0;
+  while (!done) {
+    size_t parsed = pipeline_wait(pipeline);
+    for (size_t i = 0; i < parsed; i++) {
+      job_command_t *command = pipeline_command(pipeline, i);
+      size_t size = jobc_encode(command, record);
+      if (size > 0 && fwrite(record, size, 1, out) != 1) {
+        failed = 1;
+      }
+      done = done || command->cmd == EOC;
+    }
+    pipeline_release(pipeline, parsed);
+  }
+
+  pipeline_stop(pipeline);
+  failed = fflush(out) != 0 || fsync(out_fd) != 0 || failed;
+  failed = fclose(out) != 0 || failed;
+  if (failed || rename(tmp_path, jobc_path) != 0) {
+    fprintf(stderr, "Failed to write compiled job: %s\n", jobc_path);
+    unlink(tmp_path);
+    failed = 1;
+  }
+  free(record);
+  free(pipeline);
+  close(fd);
+  return failed;
+}
+
+// Compiles .job files into .jobc files, which the server executes instead of
+// the .job (unless made with COMPILED_JOBS=0) for as long as the .job is not
+// modified.
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <job_file>...\n", argv[0]);
+    return 1;
+  }
+
+  int result = 0;
+  for (int i = 1; i < argc; i++) {
+    if (compile(argv[i])) {
+      result = 1;
+    }
+  }
+  return result;
+}
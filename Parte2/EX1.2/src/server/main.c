@@ -7,51 +7,83 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
 
+#include "backup.h"
 #include "constants.h"
 #include "io.h"
+#include "jobc.h"
+#include "jobs.h"
+#include "kvs.h"
 #include "operations.h"
+#include "parallel.h"
 #include "parser.h"
+#include "pipeline.h"
 #include "queue.h"
+#include "sessions.h"
 #include "pthread.h"
 #include "../common/io.h"
 #include "../common/constants.h"
 
-struct SharedData {
-  DIR *dir;
-  char *dir_name;
-  pthread_mutex_t directory_mutex;
-};
-
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t n_current_backups_lock = PTHREAD_MUTEX_INITIALIZER;
 
-session_t *sessions[MAX_SESSION_COUNT];
-int connected_ids=0;
-int active_threads=1;
-size_t active_backups = 0; // Number of active backups
 size_t max_backups;        // Maximum allowed simultaneous backups
 size_t max_threads;        // Maximum allowed simultaneous threads
 char *jobs_directory = NULL;
 int sigusr1_triggered = false;
 
-int filter_job_files(const struct dirent *entry);
-static int entry_files(const char *dir, struct dirent *entry, char *in_path,char *out_path);
-static int run_job(int in_fd, int out_fd, char *filename);
+int filter_job_files(const char *name);
+static int entry_files(const char *dir, const char *path, char *in_path,char *out_path);
 static void *get_file(void *arguments);
-static void dispatch_threads(DIR *dir,int server_fd);
-void create_session(session_t *session, char req_pipe_path[],char resp_pipe_path[],char noti_pipe_path[]);
-void *manager_thread(void *arg);
+static void dispatch_threads(int server_fd, int listen_fd);
+void create_session(session_t *session, const char req_pipe_path[],const char resp_pipe_path[],const char noti_pipe_path[],const char shm_name[]);
+void *connect_thread(void *arg);
+void *accept_thread(void *arg);
+int handle_request(session_t *session);
 int addKey(char array[][MAX_STRING_SIZE],char key[]);
-int removeKey(char array[][MAX_STRING_SIZE],char key[]);
-void updateKey(size_t num_pairs,char keys[][MAX_STRING_SIZE],char values[][MAX_STRING_SIZE], int mode);
-int existentKey(char array[][MAX_STRING_SIZE],char key[]);
-int remove_session(session_t *session);
+int removeKey(char array[][MAX_STRING_SIZE],const char key[]);
+void updateKey(size_t num_pairs,const char *keys[],const char *values[], int mode);
+int existentKey(char array[][MAX_STRING_SIZE],const char key[]);
+static subscriptions_t *find_subscriptions(session_t *session,
+                                           uint16_t channel, int create);
+static int drop_subscriptions(session_t *session,
+                              subscriptions_t *subscriptions);
+static void drop_if_empty(session_t *session, subscriptions_t *subscriptions);
+void close_session(session_t *session);
+
+
+// Listens for sessions on a Unix socket, beside the register pipe.
+// @param server_pipe_path Path of the register pipe, that of the socket
+// being it followed by ".sock".
+// @return The socket, -1 if it could not be created.
+static int listen_socket(const char *server_pipe_path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(server_pipe_path) + sizeof(".sock") > sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strcpy(addr.sun_path, server_pipe_path);
+  strcat(addr.sun_path, ".sock");
+  unlink(addr.sun_path);
 
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
 
 static void sig_handler(int sig) {
   sigusr1_triggered = true;
@@ -59,14 +91,18 @@ static void sig_handler(int sig) {
 }
 
 int main(int argc, char **argv) {
-  if (argc < 4) {
+  if (argc < 5) {
     write_str(STDERR_FILENO, "Usage: ");
     write_str(STDERR_FILENO, argv[0]);
     write_str(STDERR_FILENO, " <jobs_dir>");
     write_str(STDERR_FILENO, " <max_threads>");
-    write_str(STDERR_FILENO, " <max_backups> \n");
+    write_str(STDERR_FILENO, " <max_backups>");
+    write_str(STDERR_FILENO, " <register_pipe_name>");
+    write_str(STDERR_FILENO, " [connect_queue_size] \n");
     return 1;
   }
+  // A client gone while being written to is seen as EPIPE
+  signal(SIGPIPE, SIG_IGN);
   char server_pipe_path[256] = "/tmp/";
   strncat(server_pipe_path, argv[4], strlen(argv[4]) * sizeof(char));
   jobs_directory = argv[1];
@@ -95,38 +131,66 @@ int main(int argc, char **argv) {
     write_str(STDERR_FILENO, "Invalid number of threads\n");
     return 0;
   }
+
+  // Connect requests read and not yet taken by a connect thread
+  size_t queue_size = QUEUE_BUFFER_SIZE;
+  if (argc > 5) {
+    queue_size = strtoul(argv[5], &endptr, 10);
+    if (*endptr != '\0' || queue_size == 0) {
+      fprintf(stderr, "Invalid connect_queue_size value\n");
+      return 1;
+    }
+  }
   // Initialize pipe
   int register_fifo;
   if (initialize_pipe(server_pipe_path)) {
     return 1;
   }
   openPipe(&register_fifo, server_pipe_path);
+  // Sessions connect to it too, with SOCKET_TRANSPORT
+  int listen_fd = -1;
+  if (SOCKET_TRANSPORT && (listen_fd = listen_socket(server_pipe_path)) < 0) {
+    write_str(STDERR_FILENO, "Failed to listen for sessions\n");
+    return 1;
+  }
 
   if (kvs_init()) {
     write_str(STDERR_FILENO, "Failed to initialize KVS\n");
     return 1;
   }
 
-  DIR *dir = opendir(argv[1]);
-  if (dir == NULL) {
-    fprintf(stderr, "Failed to open directory: %s\n", argv[1]);
+  if (PARALLEL_COMMANDS && parallel_init()) {
+    write_str(STDERR_FILENO, "Failed to start parallel command workers\n");
+    return 1;
+  }
+
+  if (backup_scheduler_init(max_backups)) {
+    write_str(STDERR_FILENO, "Failed to initialize backup scheduler\n");
+    return 1;
+  }
+
+  // Every worker takes jobs from its own deque, largest first
+  if (jobs_init(argv[1], filter_job_files, max_threads)) {
     return 0;
   }
   //initialize producer-consumer buffer
-  if (queue_init()) 
+  if (queue_init(queue_size)) 
+    return 1;
+
+  if (sessions_init(handle_request)) {
+    write_str(STDERR_FILENO, "Failed to start serving sessions\n");
     return 1;
+  }
   
-  dispatch_threads(dir,register_fifo);
+  dispatch_threads(register_fifo, listen_fd);
 
+  sessions_terminate();
 
-  if (closedir(dir) == -1) {
-    fprintf(stderr, "Failed to close directory\n");
-    return 0;
-  }
+  jobs_destroy();
 
-  while (active_backups > 0) {
-    wait(NULL);
-    active_backups--;
+  backup_scheduler_terminate();
+  if (PARALLEL_COMMANDS) {
+    parallel_terminate();
   }
   unlink(argv[4]);
   kvs_terminate();
@@ -134,30 +198,33 @@ int main(int argc, char **argv) {
   return 0;
 }
 
-int filter_job_files(const struct dirent *entry) {
-  const char *dot = strrchr(entry->d_name, '.');
+int filter_job_files(const char *name) {
+  const char *dot = strrchr(name, '.');
   if (dot != NULL && strcmp(dot, ".job") == 0) {
     return 1; // Keep this file (it has the .job extension)
   }
   return 0;
 }
 
-static int entry_files(const char *dir, struct dirent *entry, char *in_path,
+// @param path Path of the job relative to dir (see jobs_next).
+static int entry_files(const char *dir, const char *path, char *in_path,
                        char *out_path) {
-  const char *dot = strrchr(entry->d_name, '.');
-  if (dot == NULL || dot == entry->d_name || strlen(dot) != 4 ||
+  const char *name = strrchr(path, '/');
+  name = name != NULL ? name + 1 : path;
+  const char *dot = strrchr(name, '.');
+  if (dot == NULL || dot == name || strlen(dot) != 4 ||
       strcmp(dot, ".job")) {
     return 1;
   }
 
-  if (strlen(entry->d_name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
-    fprintf(stderr, "%s/%s\n", dir, entry->d_name);
+  if (strlen(path) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
+    fprintf(stderr, "%s/%s\n", dir, path);
     return 1;
   }
 
   strcpy(in_path, dir);
   strcat(in_path, "/");
-  strcat(in_path, entry->d_name);
+  strcat(in_path, path);
 
   strcpy(out_path, in_path);
   strcpy(strrchr(out_path, '.'), ".out");
@@ -165,56 +232,233 @@ static int entry_files(const char *dir, struct dirent *entry, char *in_path,
   return 0;
 }
 
-static int run_job(int in_fd, int out_fd, char *filename) {
-  size_t file_backups = 0;
-  while (1) {
-    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    unsigned int delay;
-    size_t num_pairs;
+// What is kept between batches about a WRITE, READ or DELETE whose chunks are
+// not all applied yet.
+typedef struct {
+  int locked;  // the table stays locked until its last chunk (ATOMIC_COMMANDS)
+  int missing; // DELETE, see kvs_op_t
+  // Keys changed while the table stays locked, notified once it is unlocked:
+  // notifying takes the keys_lock of every session, which a SUBSCRIBE holds
+  // while it locks the table
+  struct key_change *changes;
+  size_t num_changes;
+  size_t max_changes;
+} batch_state_t;
+
+// A key changed by a WRITE or DELETE, copied since the command is freed
+// before it is notified.
+typedef struct key_change {
+  int deleted;
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+} key_change_t;
+
+// Keeps the keys changed by a command, to notify them once the table is
+// unlocked.
+// @return 0 if no errors, 1 if they could not be kept (they are then lost).
+static int defer_changes(batch_state_t *state, const kvs_op_t *op) {
+  if (state->num_changes + op->num_pairs > state->max_changes) {
+    size_t max = state->max_changes > 0 ? state->max_changes : MAX_WRITE_SIZE;
+    while (max < state->num_changes + op->num_pairs) {
+      max *= 2;
+    }
+    key_change_t *grown = realloc(state->changes, max * sizeof(key_change_t));
+    if (grown == NULL) {
+      return 1;
+    }
+    state->changes = grown;
+    state->max_changes = max;
+  }
+  for (size_t i = 0; i < op->num_pairs; i++) {
+    key_change_t *change = &state->changes[state->num_changes++];
+    change->deleted = op->cmd == CMD_DELETE;
+    strncpy(change->key, op->keys[i], MAX_STRING_SIZE - 1);
+    change->key[MAX_STRING_SIZE - 1] = '\0';
+    change->value[0] = '\0';
+    if (!change->deleted) {
+      strncpy(change->value, op->values[i], MAX_STRING_SIZE - 1);
+      change->value[MAX_STRING_SIZE - 1] = '\0';
+    }
+  }
+  return 0;
+}
 
-    switch (get_next(in_fd)) {
-    case CMD_WRITE:
-      num_pairs =
-          parse_write(in_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-      if (num_pairs == 0) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
-      }
+// Notifies the keys changed while the table stayed locked, in order, each
+// run of WRITEs or DELETEs at once.
+static void notify_changes(batch_state_t *state) {
+  const char *keys[MAX_WRITE_SIZE];
+  const char *values[MAX_WRITE_SIZE];
+  size_t start = 0;
+  while (start < state->num_changes) {
+    int deleted = state->changes[start].deleted;
+    size_t count = 0;
+    while (start + count < state->num_changes && count < MAX_WRITE_SIZE &&
+           state->changes[start + count].deleted == deleted) {
+      keys[count] = state->changes[start + count].key;
+      values[count] = state->changes[start + count].value;
+      count++;
+    }
+    updateKey(count, keys, values, deleted);
+    start += count;
+  }
+  state->num_changes = 0;
+}
 
-      if (kvs_write(num_pairs, keys, values)) {
-        write_str(STDERR_FILENO, "Failed to write pair\n");
-      }
-      updateKey(num_pairs,keys,values,0);
+// Applies the longest run of WRITE, READ and DELETE commands at the start of
+// the parsed ones that can share a lock: only READs, or no READs at all.
+// With PARALLEL_COMMANDS, READs are mixed with the others under the exclusive
+// lock instead (unless the table is still locked for a command in chunks),
+// since their order is kept by the keys they have in common.
+// @param pipeline Pipeline the commands were parsed by.
+// @param parsed Number of commands parsed.
+// @param out_fd File descriptor of the output.
+// @param state State of a command split in chunks, kept between calls.
+// @return Number of commands applied.
+static size_t run_batch(job_pipeline_t *pipeline, size_t parsed, int out_fd,
+                        batch_state_t *state) {
+  kvs_op_t ops[PIPELINE_DEPTH];
+  int reads = pipeline_command(pipeline, 0)->cmd == CMD_READ;
+  size_t num_ops = 0;
+  while (num_ops < parsed) {
+    job_command_t *command = pipeline_command(pipeline, num_ops);
+    if ((command->cmd != CMD_WRITE && command->cmd != CMD_READ &&
+         command->cmd != CMD_DELETE) ||
+        ((!PARALLEL_COMMANDS || state->locked) &&
+         (command->cmd == CMD_READ) != reads)) {
       break;
+    }
+    reads = reads && command->cmd == CMD_READ;
+    ops[num_ops++] = (kvs_op_t){command->cmd,        command->num_pairs,
+                                command->keys,       command->values,
+                                !command->continued, !command->more,
+                                &state->missing};
+  }
 
-    case CMD_READ:
-      num_pairs =
-          parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+  if (!state->locked && kvs_lock(!reads)) {
+    write_str(STDERR_FILENO, "Failed to apply commands\n");
+    return num_ops;
+  }
+  if (PARALLEL_COMMANDS) {
+    parallel_apply(num_ops, ops, out_fd);
+  } else {
+    kvs_apply(num_ops, ops, out_fd);
+  }
+  // With ATOMIC_COMMANDS, no other job sees a command half applied
+  state->locked = ATOMIC_COMMANDS && !ops[num_ops - 1].last;
+  if (!state->locked) {
+    kvs_unlock();
+  }
 
-      if (num_pairs == 0) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
+  // Never notified with the table locked, so no other job sees a command
+  // half applied through them either
+  if (!state->locked) {
+    notify_changes(state);
+  }
+  for (size_t i = 0; i < num_ops; i++) {
+    if (ops[i].cmd != CMD_WRITE && ops[i].cmd != CMD_DELETE) {
+      // nothing changed
+    } else if (state->locked) {
+      if (defer_changes(state, &ops[i])) {
+        write_str(STDERR_FILENO, "Failed to keep changes to notify\n");
       }
+    } else {
+      updateKey(ops[i].num_pairs, ops[i].keys, ops[i].values,
+                ops[i].cmd == CMD_DELETE);
+    }
+    if (pipeline_command(pipeline, i)->aborted) {
+      write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+    }
+  }
+  return num_ops;
+}
 
-      if (kvs_read(num_pairs, keys, out_fd)) {
-        write_str(STDERR_FILENO, "Failed to read pair\n");
-      }
-      break;
+// A job being run, kept while it is suspended on a WAIT.
+typedef struct {
+  job_pipeline_t pipeline; // parsed ahead of the commands being executed
+  int in_fd;
+  int compiled_fd; // -1 if the .job itself is parsed
+  int out_fd;
+  char *filename; // relative to the jobs directory, freed with the job
+  size_t file_backups;
+  batch_state_t batch_state;
+  struct timespec until; // end of the WAIT it is suspended on
+} job_t;
+
+// Starts parsing a job.
+// @param in_fd File descriptor of the .job.
+// @param out_fd File descriptor of the output.
+// @param filename Path of the job (see jobs_next), taken by the job.
+// @return The job, or NULL if it could not be started (the file descriptors
+// are then closed, and filename freed).
+static job_t *start_job(const char *in_path, int in_fd, int out_fd,
+                        char *filename) {
+  job_t *job = malloc(sizeof(job_t));
+  // A .jobc compiled from the job as it is now saves parsing it again
+  int compiled_fd = COMPILED_JOBS ? jobc_open(in_path, in_fd) : -1;
+  if (job == NULL ||
+      pipeline_start(&job->pipeline, compiled_fd >= 0 ? compiled_fd : in_fd,
+                     compiled_fd >= 0) != 0) {
+    write_str(STDERR_FILENO, "Failed to start parsing job\n");
+    if (compiled_fd >= 0) {
+      close(compiled_fd);
+    }
+    close(in_fd);
+    close(out_fd);
+    free(filename);
+    free(job);
+    return NULL;
+  }
 
-    case CMD_DELETE:
-      num_pairs =
-          parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+  job->in_fd = in_fd;
+  job->compiled_fd = compiled_fd;
+  job->out_fd = out_fd;
+  job->filename = filename;
+  job->file_backups = 0;
+  job->batch_state = (batch_state_t){0, 0, NULL, 0, 0};
+  return job;
+}
 
-      if (num_pairs == 0) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
-      }
+// Stops a job and frees it.
+static void end_job(job_t *job) {
+  // Ended in the middle of a command in chunks, which only a corrupted .jobc
+  // would do: its chunks applied are let through rather than the table
+  // being left locked
+  if (job->batch_state.locked) {
+    kvs_unlock();
+    job->batch_state.locked = 0;
+    notify_changes(&job->batch_state);
+  }
+  pipeline_stop(&job->pipeline);
+  if (job->compiled_fd >= 0) {
+    close(job->compiled_fd);
+  }
+  close(job->in_fd);
+  close(job->out_fd);
+  free(job->batch_state.changes);
+  free(job->filename);
+  free(job);
+}
 
-      if (kvs_delete(num_pairs, keys, out_fd)) {
-        write_str(STDERR_FILENO, "Failed to delete pair\n");
-      }
-      updateKey(num_pairs,keys,values,1);
+// Runs a job until its end or a WAIT, which does not block: the job is
+// suspended instead, so that its worker can run others meanwhile.
+// @param job Job to run, started or resumed.
+// @return 0 at the end of the job, 2 if it is to be suspended until
+// job->until.
+static int run_job(job_t *job) {
+  job_pipeline_t *pipeline = &job->pipeline;
+  int out_fd = job->out_fd;
+  int result = -1;
+  while (result < 0) {
+    size_t parsed = pipeline_wait(pipeline);
+    job_command_t *command = pipeline_command(pipeline, 0);
+    size_t executed = 1;
+    int aux;
+
+    switch (command->cmd) {
+    case CMD_WRITE:
+    case CMD_READ:
+    case CMD_DELETE:
+      executed = run_batch(pipeline, parsed, out_fd, &job->batch_state);
       break;
 
     case CMD_SHOW:
@@ -222,31 +466,25 @@ static int run_job(int in_fd, int out_fd, char *filename) {
       break;
 
     case CMD_WAIT:
-      if (parse_wait(in_fd, &delay, NULL) == -1) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
-      }
-
-      if (delay > 0) {
-        printf("Waiting %d seconds\n", delay / 1000);
-        kvs_wait(delay);
+      if (command->delay > 0) {
+        printf("Waiting %d seconds\n", command->delay / 1000);
+        clock_gettime(CLOCK_MONOTONIC, &job->until);
+        job->until.tv_sec += command->delay / 1000;
+        job->until.tv_nsec += (long)(command->delay % 1000) * 1000000;
+        if (job->until.tv_nsec >= 1000000000) {
+          job->until.tv_sec++;
+          job->until.tv_nsec -= 1000000000;
+        }
+        result = 2;
       }
       break;
 
     case CMD_BACKUP:
-      pthread_mutex_lock(&n_current_backups_lock);
-      if (active_backups >= max_backups) {
-        wait(NULL);
-      } else {
-        active_backups++;
-      }
-      pthread_mutex_unlock(&n_current_backups_lock);
-      int aux = kvs_backup(++file_backups, filename, jobs_directory);
+      // Blocks while max_backups backups are running: each is a copy of the table
+      aux = kvs_backup(++job->file_backups, job->filename, jobs_directory);
 
       if (aux < 0) {
         write_str(STDERR_FILENO, "Failed to do backup\n");
-      } else if (aux == 1) {
-        return 1;
       }
       break;
 
@@ -272,79 +510,116 @@ static int run_job(int in_fd, int out_fd, char *filename) {
 
     case EOC:
       printf("EOF\n");
-      return 0;
+      result = 0;
+      break;
     }
+
+    pipeline_release(pipeline, executed);
   }
+
+  return result;
 }
 
-// frees arguments
+// Runs jobs, and resumes the ones suspended, until there are none left.
+// @param arguments Index of the worker (see jobs_next).
 static void *get_file(void *arguments) {
-  struct SharedData *thread_data = (struct SharedData *)arguments;
-  DIR *dir = thread_data->dir;
-  char *dir_name = thread_data->dir_name;
+  size_t worker = (size_t)(intptr_t)arguments;
 
-  if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
-    fprintf(stderr, "Thread failed to lock directory_mutex\n");
-    return NULL;
-  }
-
-  struct dirent *entry;
+  char *path;
+  void *resumed;
   char in_path[MAX_JOB_FILE_NAME_SIZE], out_path[MAX_JOB_FILE_NAME_SIZE];
-  while ((entry = readdir(dir)) != NULL) {
-    if (entry_files(dir_name, entry, in_path, out_path)) {
-      continue;
-    }
+  while ((path = jobs_next(worker, &resumed)) != NULL || resumed != NULL) {
+    job_t *job = resumed;
+    if (job != NULL) {
+      pipeline_resume(&job->pipeline);
+    } else {
+      if (entry_files(jobs_directory, path, in_path, out_path)) {
+        free(path);
+        jobs_finish();
+        continue;
+      }
 
-    if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
-      fprintf(stderr, "Thread failed to unlock directory_mutex\n");
-      return NULL;
-    }
+      int in_fd = open(in_path, O_RDONLY);
+      if (in_fd == -1) {
+        write_str(STDERR_FILENO, "Failed to open input file: ");
+        write_str(STDERR_FILENO, in_path);
+        write_str(STDERR_FILENO, "\n");
+        free(path);
+        jobs_finish();
+        pthread_exit(NULL);
+      }
 
-    int in_fd = open(in_path, O_RDONLY);
-    if (in_fd == -1) {
-      write_str(STDERR_FILENO, "Failed to open input file: ");
-      write_str(STDERR_FILENO, in_path);
-      write_str(STDERR_FILENO, "\n");
-      pthread_exit(NULL);
-    }
+      int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (out_fd == -1) {
+        write_str(STDERR_FILENO, "Failed to open output file: ");
+        write_str(STDERR_FILENO, out_path);
+        write_str(STDERR_FILENO, "\n");
+        close(in_fd);
+        free(path);
+        jobs_finish();
+        pthread_exit(NULL);
+      }
 
-    int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (out_fd == -1) {
-      write_str(STDERR_FILENO, "Failed to open output file: ");
-      write_str(STDERR_FILENO, out_path);
-      write_str(STDERR_FILENO, "\n");
-      pthread_exit(NULL);
+      job = start_job(in_path, in_fd, out_fd, path);
+      if (job == NULL) {
+        jobs_finish();
+        continue;
+      }
     }
 
-    int out = run_job(in_fd, out_fd, entry->d_name);
-
-    close(in_fd);
-    close(out_fd);
-
-    if (out) {
-      if (closedir(dir) == -1) {
-        fprintf(stderr, "Failed to close directory\n");
-        return 0;
+    int out;
+    while ((out = run_job(job)) == 2) {
+      // A job put aside keeps no parser thread
+      pipeline_pause(&job->pipeline);
+      if (jobs_suspend(job, &job->until) == 0) {
+        break;
       }
-
-      exit(0);
+      // Waits in place if the job can not be put aside
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &job->until, NULL);
+      pipeline_resume(&job->pipeline);
     }
-
-    if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
-      fprintf(stderr, "Thread failed to lock directory_mutex\n");
-      return NULL;
+    if (out == 2) {
+      continue;
     }
+    end_job(job);
+    jobs_finish();
   }
 
-  if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
-    fprintf(stderr, "Thread failed to unlock directory_mutex\n");
+  pthread_exit(NULL);
+}
+
+// Reads a connect request: the request, response and notification pipe
+// paths, and maybe the name of shared memory, each ended by '\0'.
+// @return The session requested, allocated with malloc, NULL if the request
+// is invalid.
+static session_t *parse_connect(const char *payload, size_t size) {
+  const char *paths[4];
+  size_t offset = 0;
+  int i;
+  for (i = 0; i < 4 && offset < size; i++) {
+    paths[i] = payload + offset;
+    size_t len = strnlen(paths[i], size - offset);
+    if (len == size - offset || len >= MAX_PIPE_PATH_LENGTH) {
+      break;
+    }
+    offset += len + 1;
+  }
+  if (i < 3) {
+    fprintf(stderr, "Invalid connect request\n");
     return NULL;
   }
 
-  pthread_exit(NULL);
+  session_t *session = malloc(sizeof(session_t));
+  if (session == NULL) {
+    fprintf(stderr, "Failed to allocate memory for session\n");
+    return NULL;
+  }
+  create_session(session, paths[0], paths[1], paths[2],
+                 i == 4 ? paths[3] : "");
+  return session;
 }
 
-static void dispatch_threads(DIR *dir ,int server_fd) {
+static void dispatch_threads(int server_fd, int listen_fd) {
   pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
 
   if (threads == NULL) {
@@ -352,14 +627,10 @@ static void dispatch_threads(DIR *dir ,int server_fd) {
     return;
   }
 
-  struct SharedData thread_data = {dir, jobs_directory,
-                                   PTHREAD_MUTEX_INITIALIZER};
-
   for (size_t i = 0; i < max_threads; i++) {
-    if (pthread_create(&threads[i], NULL, get_file, (void *)&thread_data) !=
+    if (pthread_create(&threads[i], NULL, get_file, (void *)(intptr_t)i) !=
         0) {
       fprintf(stderr, "Failed to create thread %zu\n", i);
-      pthread_mutex_destroy(&thread_data.directory_mutex);
       free(threads);
       return;
     }
@@ -371,68 +642,158 @@ static void dispatch_threads(DIR *dir ,int server_fd) {
   }
   // Create worker threads
   
-  pthread_t thread[MAX_SESSION_COUNT];
-  for (size_t i = 0; i < MAX_SESSION_COUNT; i++) {
-    pthread_create(thread + i, NULL, manager_thread, (void *)i);
+  pthread_t thread[CONNECT_THREADS];
+  for (size_t i = 0; i < CONNECT_THREADS; i++) {
+    pthread_create(thread + i, NULL, connect_thread, (void *)i);
+  }
+  pthread_t acceptor;
+  if (listen_fd >= 0 &&
+      pthread_create(&acceptor, NULL, accept_thread,
+                     (void *)(intptr_t)listen_fd) != 0) {
+    fprintf(stderr, "Failed to create accept thread\n");
   }
   // ler do FIFO de registo
-  while(1){
+  // Every connect request read at once is queued at once. One read only in
+  // part is kept for the next read
+  char *records = malloc(REGISTER_BUFFER_SIZE);
+  session_t **sessions =
+      malloc(REGISTER_BUFFER_SIZE / sizeof(message_header_t) *
+             sizeof(session_t *));
+  size_t filled = 0;
+  while (records != NULL && sessions != NULL) {
     if(sigusr1_triggered==true){
       printf("Shutting down sessions...\n");
-      for(int i=0;i<MAX_SESSION_COUNT;i++){
-        if(sessions[i]!=NULL){
-          printf("Removing session %d\n",sessions[i]->id);
-          unlink(sessions[i]->request_pipe);
-          unlink(sessions[i]->response_pipe);
-          unlink(sessions[i]->noti_pipe);
-          free(sessions[i]);
-          sessions[i]=NULL;
-        }
-        
-      }
-      connected_ids=0;
-      active_threads=1;
+      sessions_close_all();
       sigusr1_triggered=false;
     }
-    char buf[1];
-    ssize_t num_read = read(server_fd, buf, 1);
-    if (num_read > 0){
-      if(buf[0]=='1'){
-        session_t session;
-        char req_pipe_path[41];
-        char resp_pipe_path[41];
-        char noti_pipe_path[41];
-        read(server_fd,req_pipe_path,40);req_pipe_path[40]='\0';
-        read(server_fd,resp_pipe_path,40);resp_pipe_path[40]='\0';
-        read(server_fd,noti_pipe_path,40);noti_pipe_path[40]='\0';
-
-        create_session(&session, req_pipe_path,resp_pipe_path,noti_pipe_path);
-        //printf("Placing session %s in queue\n",session.request_pipe);
-        queue_produce(&session);
-        //printf("Session %s is now in queue\n",session.request_pipe);
-
+    ssize_t num_read = read(server_fd, records + filled,
+                            REGISTER_BUFFER_SIZE - filled);
+    if (num_read <= 0) {
+      if (num_read < 0 && errno != EINTR) {
+        fprintf(stderr, "Failed to read from register pipe\n");
+        break;
       }
+      continue;
     }
+    filled += (size_t)num_read;
+
+    size_t pos = 0;
+    size_t count = 0;
+    message_header_t header;
+    while (filled - pos >= sizeof(header)) {
+      memcpy(&header, records + pos, sizeof(header));
+      if (header.payload_size > MAX_PAYLOAD_SIZE) {
+        // Not a message: what follows can not be told apart
+        fprintf(stderr, "Invalid connect request\n");
+        pos = filled;
+        break;
+      }
+      if (filled - pos < sizeof(header) + header.payload_size) {
+        break;
+      }
+      if (header.opcode == OP_CODE_CONNECT) {
+        session_t *session = parse_connect(
+            records + pos + sizeof(header), header.payload_size);
+        if (session != NULL) {
+          sessions[count++] = session;
+        }
+      }
+      pos += sizeof(header) + header.payload_size;
+    }
+    memmove(records, records + pos, filled - pos);
+    filled -= pos;
+    //printf("Placing %zu sessions in queue\n",count);
+    queue_produce_many(sessions, count);
   }
+  free(records);
+  free(sessions);
 
   for (unsigned int i = 0; i < max_threads; i++) {
     if (pthread_join(threads[i], NULL) != 0) {
       fprintf(stderr, "Failed to join thread %u\n", i);
-      pthread_mutex_destroy(&thread_data.directory_mutex);
       free(threads);
       return;
     }
   }
 
-  if (pthread_mutex_destroy(&thread_data.directory_mutex) != 0) {
-    fprintf(stderr, "Failed to destroy directory_mutex\n");
+  free(threads);
+}
+// Maps the shared memory a client offered for a session.
+// @return The memory, NULL if it could not be used (the session then uses its
+// pipes).
+static shm_channel_t *map_channel(const char *shm_name) {
+  int fd = shm_open(shm_name, O_RDWR, 0);
+  if (fd < 0) {
+    return NULL;
   }
+  struct stat st;
+  shm_channel_t *channel = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size == sizeof(shm_channel_t)) {
+    channel = mmap(NULL, sizeof(shm_channel_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    if (channel == MAP_FAILED) {
+      channel = NULL;
+    } else if (channel->magic != SHM_CHANNEL_MAGIC ||
+               channel->size != sizeof(shm_channel_t)) {
+      munmap(channel, sizeof(shm_channel_t));
+      channel = NULL;
+    }
+  }
+  close(fd);
+  return channel;
+}
 
-  free(threads);
+// Opens the FIFOs of a new session, in the order the client opens them, and
+// acknowledges the connect. They stay open until the session ends. If the
+// client offered shared memory, the ack says whether it is used. The pipes
+// are then used without blocking: a client leaving its pipe full, or a
+// request half-written (see read_all), has its session ended rather than
+// holding up the thread serving or notifying it.
+// @return 0 if no errors, 1 otherwise (the ones opened are then closed)
+static int open_session(session_t *session) {
+  session->request_fd = session->noti_fd = -1;
+  uint8_t uses_channel = 0;
+  if (SHM_TRANSPORT && session->shm_name[0] != '\0') {
+    session->channel = map_channel(session->shm_name);
+    uses_channel = session->channel != NULL;
+  }
+  message_header_t ack = {OP_CODE_CONNECT, 0, 0, 0,
+                          session->shm_name[0] != '\0' ? 1 : 0};
+  session->response_fd = open(session->response_pipe, O_WRONLY);
+  if (session->response_fd < 0 ||
+      send_message(session->response_fd, &ack, &uses_channel) < 0 ||
+      (session->noti_fd = open(session->noti_pipe, O_WRONLY)) < 0 ||
+      (session->request_fd = open(session->request_pipe, O_RDONLY)) < 0 ||
+      fcntl(session->request_fd, F_SETFL, O_NONBLOCK) ||
+      fcntl(session->response_fd, F_SETFL, O_NONBLOCK) ||
+      fcntl(session->noti_fd, F_SETFL, O_NONBLOCK)) {
+    close_session(session);
+    return 1;
+  }
+  return 0;
 }
-void *manager_thread(void *arg) {
-  unsigned int session_id = (unsigned int)(intptr_t)arg;
-  session_t *session=malloc(sizeof(session_t));
+
+void close_session(session_t *session) {
+  if (session->request_fd >= 0) {
+    close(session->request_fd);
+  }
+  if (session->response_fd >= 0) {
+    close(session->response_fd);
+  }
+  if (session->noti_fd >= 0) {
+    close(session->noti_fd);
+  }
+  session->request_fd = session->response_fd = session->noti_fd = -1;
+  if (session->channel != NULL) {
+    munmap(session->channel, sizeof(shm_channel_t));
+    session->channel = NULL;
+  }
+}
+
+// Opens the pipes of the sessions registered, which blocks until their
+// clients open them too, and hands them to the session threads.
+void *connect_thread(void *arg) {
+  (void)arg;
   sigset_t set;
   sigemptyset(&set);
   sigaddset(&set, SIGUSR1);
@@ -443,102 +804,407 @@ void *manager_thread(void *arg) {
   
   while (1) {
     // Take session from producer-consumer buffer
-    int resp_pipe, req_pipe;
-    queue_consume(session, session_id);
-    for (int i=0;i<MAX_SESSION_COUNT;i++){
-      if(sessions[i]==NULL){
-        sessions[i]=session;
-        break;
-      }
-      
-    }
-    //printf("Consumed session for %s\n",session->request_pipe);
-    resp_pipe=open(session->response_pipe, O_WRONLY);
-    write(resp_pipe,"10",2);
-    close(resp_pipe);
-
-    while(1){
-     req_pipe=open(session->request_pipe, O_RDONLY);
-     resp_pipe=open(session->response_pipe, O_WRONLY);
-      if (req_pipe<0||resp_pipe<0){
-        close(req_pipe);
-        close(resp_pipe);
-        break;
-      }
-      char buf[1];
-      ssize_t num_read = read(req_pipe, buf, 1);
+    session_t *session = queue_consume();
+    if (open_session(session)) {
+      fprintf(stderr, "Failed to open the pipes of a session\n");
+      free(session);
+      continue;
+    }
+    if (sessions_add(session)) {
+      fprintf(stderr, "Failed to add session\n");
+      close_session(session);
+      free(session);
+    }
+  }
+  return (void *)0;
+}
 
-      if(num_read<0){
-        close(req_pipe);
-        close(resp_pipe);
-        break;
+// Accepts the sessions connecting to the socket of the server, each on its
+// own connection, and hands them to the session threads. Never blocks on a
+// client: the connect is acknowledged before its first request is read.
+void *accept_thread(void *arg) {
+  int listen_fd = (int)(intptr_t)arg;
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL)) {
+    fprintf(stderr, "Failed to block signal\n");
+    return (void *)1;
+  }
+
+  while (1) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
       }
-      if (num_read > 0){
-        if(buf[0]=='2'){
-          printf("Disconect on session %d\n",session->id);
-          if(remove_session(session)==0){
-            char message[2]="20";
-            write(resp_pipe,message,2);
-          }
-          else{
-            char message[2]="21";
-            write(resp_pipe,message,2);
-          }
-          connected_ids--;
-          close(req_pipe);
-          close(resp_pipe);
-          break;
-        }
+      // Out of descriptors: the pending connections wait
+      fprintf(stderr, "Failed to accept session\n");
+      sleep(1);
+      continue;
+    }
+    set_socket_buffers(fd);
 
+    session_t *session = malloc(sizeof(session_t));
+    if (session == NULL) {
+      fprintf(stderr, "Failed to allocate memory for session\n");
+      close(fd);
+      continue;
+    }
+    create_session(session, "", "", "", "");
+    session->socket = 1;
+    session->request_fd = fd;
+    session->response_fd = dup(fd);
+    session->noti_fd = dup(fd);
+    message_header_t ack = {OP_CODE_CONNECT, 0, 0, 0, 0};
+    // Its buffer is empty, so this does not block. Nothing sent after does
+    // either (see open_session), a socket being one descriptor however dup'd
+    if (session->response_fd < 0 || session->noti_fd < 0 ||
+        send_message(session->response_fd, &ack, NULL) < 0 ||
+        fcntl(fd, F_SETFL, O_NONBLOCK) || sessions_add(session)) {
+      fprintf(stderr, "Failed to add session\n");
+      close_session(session);
+      free(session);
+    }
+  }
+  return (void *)0;
+}
 
-        if(buf[0]=='3'){
-          printf("Subscribe on session %d\n",session->id);
-          char key[41];
-          read(req_pipe,key,41);
-          if(checkKey(key)==0&&addKey(session->keys,key)==0){
-            char message[2]="31";
-            write(resp_pipe,message,2);
-            session->num_keys++;
-          }
-          else{
-            char message[2]="30";
-            write(resp_pipe,message,2);
-          }
-        }
+// Splits a payload into strings, each ended by '\0' and shorter than
+// MAX_STRING_SIZE.
+// @param strings Where to store them, pointing into the payload.
+// @param max Most strings to accept.
+// @return Number of strings, 0 if the payload is not such a list or has more.
+static size_t split_strings(const char *payload, size_t size,
+                            const char *strings[], size_t max) {
+  size_t num = 0;
+  size_t start = 0;
+  while (start < size) {
+    const char *end = memchr(payload + start, '\0', size - start);
+    if (num == max || end == NULL ||
+        (size_t)(end - (payload + start)) >= MAX_STRING_SIZE) {
+      return 0;
+    }
+    strings[num++] = payload + start;
+    start = (size_t)(end - payload) + 1;
+  }
+  return num;
+}
 
+// Applies a WRITE, READ or DELETE requested by a client, as a job would,
+// notifying the sessions subscribed to the keys changed.
+// @param output Buffer of KVS_OP_OUTPUT_SIZE(num_pairs) bytes for the output.
+// @return Size of the output, or -1 if a key is invalid or the table could
+// not be locked.
+static ssize_t apply_request(enum Command cmd, size_t num_pairs,
+                             const char *keys[], const char *values[],
+                             char *output) {
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (hash(keys[i]) < 0) {
+      return -1;
+    }
+  }
+  int missing = 0;
+  kvs_op_t op = {cmd, num_pairs, keys, values, 1, 1, &missing};
+  if (kvs_lock(cmd != CMD_READ)) {
+    return -1;
+  }
+  size_t size = kvs_apply_concurrent(&op, output);
+  kvs_unlock();
 
-        if(buf[0]=='4'){
-          printf("Unsubscribe on session %d\n",session->id);
-          char key[41];
-          read(req_pipe,key,41);
-          if(removeKey(session->keys,key)==0){
-            char message[2]="41";
-            write(resp_pipe,message,2);
-            session->num_keys++;
-          }
-          else{
-            char message[2]="40";
-            write(resp_pipe,message,2);
-          }
-        }
+  if (cmd == CMD_WRITE) {
+    updateKey(num_pairs, keys, values, 0);
+  } else if (cmd == CMD_DELETE) {
+    updateKey(num_pairs, keys, values, 1);
+  }
+  return (ssize_t)size;
+}
+
+// Sends the response to a request of a session, the way its requests come.
+// @return 0 if sent, 1 if the client is gone (EPIPE), or its shared memory
+// has no room for it, as it would if the client left more requests
+// unanswered than allowed.
+static int reply(session_t *session, const message_header_t *response,
+                 const void *payload) {
+  if (session->replies != NULL) {
+    pthread_mutex_lock(&session->send_lock);
+    int result = batch_add(session->replies, session->response_fd, response,
+                           payload) < 0;
+    pthread_mutex_unlock(&session->send_lock);
+    return result;
+  }
+  if (session->channel == NULL) {
+    return send_message(session->response_fd, response, payload) < 0;
+  }
+  ring_t *ring = &session->channel->responses;
+  if (!ring_push(ring, response, payload)) {
+    return 1;
+  }
+  if (ring_wake_needed(ring)) {
+    ring_wake(ring);
+  }
+  return 0;
+}
+
+// Serves a request of a session.
+// @param received What receiving it returned (see receive_message).
+// @return 0 to keep serving the session, 1 to end it.
+static int serve_request(session_t *session, const message_header_t *request,
+                         char *payload, int received) {
+  // Unknown requests, and keys too long, fail with 0
+  message_header_t response = {request->opcode, 0, request->channel,
+                               request->request_id, 0};
+  char output[KVS_OP_OUTPUT_SIZE(MAX_REQUEST_PAIRS)];
+  char *key = payload;
+  if (received < 0) {
+    printf("Invalid request on session %d\n",session->id);
+  }
+  else if(request->opcode==OP_CODE_DISCONNECT){
+    printf("Disconect on session %d\n",session->id);
+    reply(session, &response, NULL);
+    return 1;
+  }
+  else if(request->opcode==OP_CODE_HEARTBEAT){
+    // Only keeps the session from being idle, answered with 0
+  }
+  else if((request->opcode==OP_CODE_SUBSCRIBE ||
+           request->opcode==OP_CODE_UNSUBSCRIBE) &&
+          (request->payload_size > MAX_STRING_SIZE ||
+           request->channel >= MAX_CHANNELS)){
+    printf("Invalid request on session %d\n",session->id);
+  }
+  else if(request->opcode==OP_CODE_SUBSCRIBE){
+    printf("Subscribe on session %d\n",session->id);
+    key[request->payload_size]='\0';
+    pthread_mutex_lock(&session->keys_lock);
+    subscriptions_t *subscriptions =
+        find_subscriptions(session, request->channel, 1);
+    if(subscriptions!=NULL){
+      if(checkKey(key)==0&&addKey(subscriptions->keys,key)==0){
+        response.result=1;
       }
-      close(resp_pipe);
-      close(req_pipe);
+      drop_if_empty(session, subscriptions);
+    }
+    pthread_mutex_unlock(&session->keys_lock);
+  }
+  else if(request->opcode==OP_CODE_UNSUBSCRIBE){
+    printf("Unsubscribe on session %d\n",session->id);
+    key[request->payload_size]='\0';
+    pthread_mutex_lock(&session->keys_lock);
+    subscriptions_t *subscriptions =
+        find_subscriptions(session, request->channel, 0);
+    if(subscriptions!=NULL&&removeKey(subscriptions->keys,key)==0){
+      response.result=1;
+      drop_if_empty(session, subscriptions);
+    }
+    pthread_mutex_unlock(&session->keys_lock);
+  }
+  else if(request->opcode==OP_CODE_CLOSE_CHANNEL){
+    printf("Close channel %u on session %d\n", request->channel, session->id);
+    pthread_mutex_lock(&session->keys_lock);
+    subscriptions_t *subscriptions =
+        find_subscriptions(session, request->channel, 0);
+    if(subscriptions!=NULL){
+      response.result=(uint8_t)drop_subscriptions(session, subscriptions);
+    }
+    pthread_mutex_unlock(&session->keys_lock);
+  }
+  else if(request->opcode==OP_CODE_WRITE){
+    printf("Write on session %d\n",session->id);
+    const char *strings[2 * MAX_REQUEST_PAIRS];
+    const char *keys[MAX_REQUEST_PAIRS], *values[MAX_REQUEST_PAIRS];
+    size_t num = split_strings(payload, request->payload_size, strings,
+                               2 * MAX_REQUEST_PAIRS);
+    for (size_t i = 0; i < num / 2; i++) {
+      keys[i] = strings[2 * i];
+      values[i] = strings[2 * i + 1];
+    }
+    response.result = num > 0 && num % 2 == 0 &&
+                      apply_request(CMD_WRITE, num / 2, keys, values,
+                                    output) >= 0
+                          ? 0
+                          : 1;
+  }
+  else if(request->opcode==OP_CODE_READ||request->opcode==OP_CODE_DELETE){
+    enum Command cmd = request->opcode == OP_CODE_READ ? CMD_READ : CMD_DELETE;
+    printf("%s on session %d\n", cmd == CMD_READ ? "Read" : "Delete",
+           session->id);
+    const char *keys[MAX_REQUEST_PAIRS];
+    size_t num = split_strings(payload, request->payload_size, keys,
+                               MAX_REQUEST_PAIRS);
+    ssize_t size = num > 0 ? apply_request(cmd, num, keys, NULL, output) : -1;
+    response.result = size >= 0 ? 0 : 1;
+    response.payload_size = size > 0 ? (uint32_t)size : 0;
+  }
+
+  if (reply(session, &response, output)) {
+    printf("Session %d closed by the client\n", session->id);
+    return 1;
+  }
+  return 0;
+}
+
+// Serves the requests in the shared memory of a session until there are no
+// more. Its request pipe then only has bytes written to wake the server up
+// once it went idle (see ring_idle), or the end of the session.
+static int serve_channel(session_t *session) {
+  char doorbell[64];
+  int size = 0;
+  if (ioctl(session->request_fd, FIONREAD, &size) != 0 || size == 0 ||
+      read(session->request_fd, doorbell,
+           (size_t)size < sizeof(doorbell) ? (size_t)size
+                                           : sizeof(doorbell)) <= 0) {
+    printf("Session %d closed by the client\n", session->id);
+    return 1;
+  }
+
+  ring_t *ring = &session->channel->requests;
+  while (1) {
+    message_header_t request;
+    char payload[MAX_PAYLOAD_SIZE + 1];
+    int received = ring_pop(ring, &request, payload, MAX_PAYLOAD_SIZE);
+    if (received == 0) {
+      if (ring_idle(ring)) {
+        return 0;
+      }
+    } else if (received == -1) {
+      printf("Invalid request on session %d\n", session->id);
+      return 1;
+    } else if (serve_request(session, &request, payload, received)) {
+      return 1;
     }
   }
-  return (void *)0;
 }
 
+// Serves every request the socket of a session has, received at once, and
+// sends their responses at once.
+static int serve_socket(session_t *session) {
+  message_batch_t requests, replies;
+  batch_init(&requests, 1);
+  batch_init(&replies, 1);
+  int received = receive_batch(&requests, session->request_fd, 0);
+  if (received == -1 && errno == EAGAIN) {
+    return 0;
+  }
+  if (received <= 0) {
+    printf("Session %d closed by the client\n", session->id);
+    return 1;
+  }
+
+  session->replies = &replies;
+  int end = 0;
+  message_header_t request;
+  char payload[MAX_PAYLOAD_SIZE + 1];
+  while (!end && (received = batch_pop(&requests, &request, payload,
+                                       MAX_PAYLOAD_SIZE)) != 0) {
+    end = serve_request(session, &request, payload, received);
+  }
+  session->replies = NULL;
+
+  pthread_mutex_lock(&session->send_lock);
+  if (send_batch(&replies, session->response_fd) < 0 && !end) {
+    printf("Session %d closed by the client\n", session->id);
+    end = 1;
+  }
+  pthread_mutex_unlock(&session->send_lock);
+  return end;
+}
 
-void create_session(session_t *session, char req_pipe_path[],char resp_pipe_path[],char noti_pipe_path[]){  
+// Serves the next request of a session (see sessions_init).
+// @return 0 to keep serving the session, 1 to end it.
+int handle_request(session_t *session) {
+  if (session->channel != NULL) {
+    return serve_channel(session);
+  }
+  if (session->socket) {
+    return serve_socket(session);
+  }
+
+  message_header_t request;
+  char payload[MAX_PAYLOAD_SIZE + 1];
+  // The client closing its end (EOF) or a failed reply (EPIPE) ends the
+  // session as a disconnect would
+  int received = receive_message(session->request_fd, &request, payload,
+                                 MAX_PAYLOAD_SIZE, NULL);
+  if (received == 0 || received == -1) {
+    printf("Session %d closed by the client\n", session->id);
+    return 1;
+  }
+  return serve_request(session, &request, payload, received);
+}
+
+void create_session(session_t *session, const char req_pipe_path[],const char resp_pipe_path[],const char noti_pipe_path[],const char shm_name[]){  
   strncpy(session->request_pipe, req_pipe_path,MAX_PIPE_PATH_LENGTH);
   strncpy(session->response_pipe, resp_pipe_path,MAX_PIPE_PATH_LENGTH);
   strncpy(session->noti_pipe, noti_pipe_path,MAX_PIPE_PATH_LENGTH);
-  session->num_keys=0;
-  for(int j=0;j<MAX_NUMBER_SUB;j++){
-    session->keys[j][0]='\0';
+  strncpy(session->shm_name, shm_name, MAX_PIPE_PATH_LENGTH);
+  session->channel = NULL;
+  session->socket = 0;
+  session->replies = NULL;
+  session->subscriptions=NULL;
+  session->num_subscriptions=session->max_subscriptions=0;
+  session->request_fd=session->response_fd=session->noti_fd=-1;
+}
+
+// Finds the keys subscribed by a channel of a session, with its keys_lock
+// held.
+// @param create Whether to add them, none yet, if the channel has none.
+// @return Them, NULL if the channel has none (and they could not be added).
+static subscriptions_t *find_subscriptions(session_t *session,
+                                           uint16_t channel, int create) {
+  for (size_t i = 0; i < session->num_subscriptions; i++) {
+    if (session->subscriptions[i].channel == channel) {
+      return &session->subscriptions[i];
+    }
   }
+  if (!create) {
+    return NULL;
+  }
+  if (session->num_subscriptions == session->max_subscriptions) {
+    size_t max = session->max_subscriptions > 0
+                     ? 2 * session->max_subscriptions
+                     : 1;
+    subscriptions_t *grown =
+        realloc(session->subscriptions, max * sizeof(subscriptions_t));
+    if (grown == NULL) {
+      return NULL;
+    }
+    session->subscriptions = grown;
+    session->max_subscriptions = max;
+  }
+  subscriptions_t *subscriptions =
+      &session->subscriptions[session->num_subscriptions++];
+  subscriptions->channel = channel;
+  for (int j = 0; j < MAX_NUMBER_SUB; j++) {
+    subscriptions->keys[j][0] = '\0';
+  }
+  return subscriptions;
+}
 
+// Removes the keys subscribed by a channel of a session, with its keys_lock
+// held. Those of the last channel take their place.
+// @return How many there were.
+static int drop_subscriptions(session_t *session,
+                              subscriptions_t *subscriptions) {
+  int count = 0;
+  for (int j = 0; j < MAX_NUMBER_SUB; j++) {
+    if (subscriptions->keys[j][0] != '\0') {
+      count++;
+    }
+  }
+  *subscriptions = session->subscriptions[--session->num_subscriptions];
+  return count;
+}
+
+// Removes the keys subscribed by a channel of a session if there are none
+// left, so that channels without keys cost nothing to notify.
+static void drop_if_empty(session_t *session, subscriptions_t *subscriptions) {
+  for (int j = 0; j < MAX_NUMBER_SUB; j++) {
+    if (subscriptions->keys[j][0] != '\0') {
+      return;
+    }
+  }
+  drop_subscriptions(session, subscriptions);
 }
 
 int addKey(char array[][MAX_STRING_SIZE],char key[]){
@@ -554,7 +1220,7 @@ int addKey(char array[][MAX_STRING_SIZE],char key[]){
   }
   return 1;
 }
-int removeKey(char array[][MAX_STRING_SIZE],char key[]){
+int removeKey(char array[][MAX_STRING_SIZE],const char key[]){
   int i=existentKey(array,key);
   if(i<0){
     return 1;
@@ -568,56 +1234,86 @@ int removeKey(char array[][MAX_STRING_SIZE],char key[]){
 
 }
 
-void updateKey(size_t num_pairs,char keys[][MAX_STRING_SIZE],char values[][MAX_STRING_SIZE], int mode){
-
-  for(size_t i=0;i<num_pairs;i++){
-    //Lookig for a session following keys[i]
-    for(size_t j=0;j<MAX_SESSION_COUNT;j++){
-      if(sessions[j]!=NULL){
-        //Trying in sessions[j]->id
-        for(size_t k=0;k<MAX_NUMBER_SUB;k++){
-          if(strcmp(sessions[j]->keys[k],keys[i])==0){
-            //Found in session sessions[j]->id
-            char message[256];
-            if(mode==0){
-              sprintf(message,"(%s,%s)",keys[i],values[i]);
-            }
-            if(mode==1){
-              sprintf(message,"(%s,DELETED)",keys[i]);
-              removeKey(sessions[i]->keys, keys[i]);
-            }
-            int noti_pipe=open(sessions[j]->noti_pipe,O_WRONLY);
-            //Writing to pipe
-            write(noti_pipe,message,strlen(message));
-          }
-          break;
-           
-        }
-
+// The keys changed by a command, for the sessions subscribed to them.
+typedef struct {
+  size_t num_pairs;
+  const char **keys;
+  const char **values; // NULL if deleted
+} notification_t;
+
+// Sends a session the changes of the keys it is subscribed to, at once.
+// @return 0 if sent, 1 if the client is gone or its notification pipe full
+// (EAGAIN), so the session is ended.
+static int notify_session(session_t *session, void *arg) {
+  const notification_t *notification = arg;
+  int failed = 0;
+  message_batch_t batch;
+  batch_init(&batch, session->socket);
+  pthread_mutex_lock(&session->keys_lock);
+  for (size_t i = 0; i < notification->num_pairs; i++) {
+    const char *key = notification->keys[i];
+    // The key and its value, each ended by '\0', once a channel has it
+    char payload[2 * MAX_STRING_SIZE + 2];
+    message_header_t header = {OP_CODE_NOTIFY, 0, 0, 0, 0};
+    for (size_t c = 0; c < session->num_subscriptions; c++) {
+      subscriptions_t *subscriptions = &session->subscriptions[c];
+      if (existentKey(subscriptions->keys, key) < 0) {
+        continue;
+      }
+      if (notification->values == NULL) {
+        removeKey(subscriptions->keys, key);
+      }
+      if (header.payload_size == 0) {
+        const char *value = notification->values != NULL
+                                ? notification->values[i]
+                                : "DELETED";
+        size_t key_size = strnlen(key, MAX_STRING_SIZE);
+        size_t value_size = strnlen(value, MAX_STRING_SIZE);
+        memcpy(payload, key, key_size);
+        payload[key_size] = '\0';
+        memcpy(payload + key_size + 1, value, value_size);
+        payload[key_size + 1 + value_size] = '\0';
+        header.payload_size = (uint32_t)(key_size + value_size + 2);
       }
+      header.channel = subscriptions->channel;
+      // Only sent here if there are more than fit
+      pthread_mutex_lock(&session->send_lock);
+      if (!failed &&
+          batch_add(&batch, session->noti_fd, &header, payload) < 0) {
+        failed = 1;
+      }
+      pthread_mutex_unlock(&session->send_lock);
+    }
+  }
+  if (notification->values == NULL) {
+    // From the last, as each dropped is replaced by the last
+    for (size_t c = session->num_subscriptions; c-- > 0;) {
+      drop_if_empty(session, &session->subscriptions[c]);
     }
   }
+  pthread_mutex_unlock(&session->keys_lock);
 
+  //Writing to pipe
+  if (!failed && batch.size > 0) {
+    pthread_mutex_lock(&session->send_lock);
+    failed = send_batch(&batch, session->noti_fd) < 0;
+    pthread_mutex_unlock(&session->send_lock);
+  }
+  if (failed) {
+    printf("Session %d not reading its notifications, closing it\n",
+           session->id);
+  }
+  return failed;
 }
 
-
-int remove_session(session_t *session){
-  for(int i=0;i<MAX_SESSION_COUNT;i++){
-    if(sessions[i]!=NULL){
-      if(sessions[i]->id==session->id){
-        free(sessions[i]);
-        sessions[i]=NULL;
-        session=NULL;
-        active_threads--;
-        return 0;
-      }
-    }
-    
-  }
-  return 1;
+void updateKey(size_t num_pairs,const char *keys[],const char *values[], int mode){
+  //Lookig for the sessions following any of the keys
+  notification_t notification = {num_pairs, keys, mode == 0 ? values : NULL};
+  sessions_for_each(notify_session, &notification);
 }
 
-int existentKey(char array[][MAX_STRING_SIZE],char key[]){
+
+int existentKey(char array[][MAX_STRING_SIZE],const char key[]){
   for(int i=0;i<MAX_NUMBER_SUB;i++){
     if(strcmp(array[i],key)==0){
       return i;
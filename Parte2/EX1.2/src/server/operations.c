@@ -1,5 +1,6 @@
 #include "operations.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,11 +9,22 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "backup.h"
+#include "compress.h"
 #include "constants.h"
 #include "io.h"
 #include "kvs.h"
 
 static struct HashTable *kvs_table = NULL;
+// Processes used to write a big backup, at most one per online CPU
+static int backup_writers = 1;
+// Incremented, with the table write locked, every time the table changes
+static unsigned long kvs_version = 0;
+// Last backup taken and the version of the table it holds, so a backup of an
+// unchanged table can be a hard link to it
+static pthread_mutex_t last_backup_lock = PTHREAD_MUTEX_INITIALIZER;
+static char last_backup_name[MAX_JOB_FILE_NAME_SIZE] = "";
+static unsigned long last_backup_version = 0;
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -27,6 +39,12 @@ int kvs_init() {
     return 1;
   }
 
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > BACKUP_WRITERS) {
+    cpus = BACKUP_WRITERS;
+  }
+  backup_writers = cpus < 1 ? 1 : (int)cpus;
+
   kvs_table = create_hash_table();
   return kvs_table == NULL;
 }
@@ -42,79 +60,221 @@ int kvs_terminate() {
   return 0;
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]) {
-  if (kvs_table == NULL) {
-    fprintf(stderr, "KVS state must be initialized\n");
-    return 1;
+// Locks the bucket of a key, when applying operations concurrently (see
+// kvs_apply_concurrent). Otherwise the table lock is enough.
+// @param exclusive Whether the bucket will be changed.
+static void lock_bucket(const char *key, int concurrent, int exclusive) {
+  int index = hash(key);
+  if (!concurrent || index < 0) {
+    return;
+  }
+  if (exclusive) {
+    pthread_rwlock_wrlock(&kvs_table->bucketlocks[index]);
+  } else {
+    pthread_rwlock_rdlock(&kvs_table->bucketlocks[index]);
+  }
+}
+
+// Unlocks the bucket of a key locked by lock_bucket.
+static void unlock_bucket(const char *key, int concurrent) {
+  int index = hash(key);
+  if (concurrent && index >= 0) {
+    pthread_rwlock_unlock(&kvs_table->bucketlocks[index]);
   }
+}
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+// Formats a "(key,value)" of the output of a READ or DELETE, cut to
+// MAX_STRING_SIZE - 1 bytes.
+// @param output Where to write it, followed by a '\0'.
+// @return Size written, not counting the '\0'.
+static size_t output_pair(char *output, const char *key, const char *value) {
+  int size = snprintf(output, MAX_STRING_SIZE, "(%s,%s)", key, value);
+  if (size < 0) {
+    output[0] = '\0';
+    return 0;
+  }
+  return (size_t)size < MAX_STRING_SIZE ? (size_t)size : MAX_STRING_SIZE - 1;
+}
 
+// Writes pairs to the table, which must be write locked.
+// @param concurrent Whether other operations are applied at the same time.
+static void write_pairs(size_t num_pairs, const char *keys[],
+                        const char *values[], int concurrent) {
   for (size_t i = 0; i < num_pairs; i++) {
+    lock_bucket(keys[i], concurrent, 1);
     if (write_pair(kvs_table, keys[i], values[i]) != 0) {
       fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
     }
+    unlock_bucket(keys[i], concurrent);
+  }
+  __atomic_fetch_add(&kvs_version, 1, __ATOMIC_RELAXED);
+}
+
+// Reads pairs from the table, which must be at least read locked.
+// @param output Buffer of KVS_OP_OUTPUT_SIZE(num_pairs) bytes for the output.
+// @param first Whether these are the first keys of their command.
+// @param last Whether these are the last keys of their command.
+// @param concurrent Whether other operations are applied at the same time.
+// @return Size of the output.
+static size_t read_pairs(size_t num_pairs, const char *keys[], char *output,
+                         int first, int last, int concurrent) {
+  size_t size = 0;
+  if (first) {
+    output[size++] = '[';
+  }
+  for (size_t i = 0; i < num_pairs; i++) {
+    lock_bucket(keys[i], concurrent, 0);
+    char *result = read_pair(kvs_table, keys[i]);
+    unlock_bucket(keys[i], concurrent);
+    size += output_pair(output + size, keys[i],
+                        result == NULL ? "KVSERROR" : result);
+    free(result);
   }
+  if (last) {
+    output[size++] = ']';
+    output[size++] = '\n';
+  }
+  output[size] = '\0';
+  return size;
+}
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
-  return 0;
+// Deletes pairs from the table, which must be write locked.
+// @param output Buffer of KVS_OP_OUTPUT_SIZE(num_pairs) bytes for the output.
+// @param first Whether these are the first keys of their command.
+// @param last Whether these are the last keys of their command.
+// @param missing Whether a missing key of the command was already reported.
+// @param concurrent Whether other operations are applied at the same time.
+// @return Size of the output.
+static size_t delete_pairs(size_t num_pairs, const char *keys[], char *output,
+                           int first, int last, int *missing, int concurrent) {
+  size_t size = 0;
+  if (first) {
+    *missing = 0;
+  }
+  for (size_t i = 0; i < num_pairs; i++) {
+    lock_bucket(keys[i], concurrent, 1);
+    int deleted = delete_pair(kvs_table, keys[i]) == 0;
+    unlock_bucket(keys[i], concurrent);
+    if (deleted) {
+      __atomic_fetch_add(&kvs_version, 1, __ATOMIC_RELAXED);
+    } else {
+      if (!*missing) {
+        output[size++] = '[';
+        *missing = 1;
+      }
+      size += output_pair(output + size, keys[i], "KVSMISSING");
+    }
+  }
+  if (last && *missing) {
+    output[size++] = ']';
+    output[size++] = '\n';
+  }
+  output[size] = '\0';
+  return size;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+int kvs_write(size_t num_pairs, const char *keys[], const char *values[]) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  write_pairs(num_pairs, keys, values, 0);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  return 0;
+}
 
-  write_str(fd, "[");
-  for (size_t i = 0; i < num_pairs; i++) {
-    char *result = read_pair(kvs_table, keys[i]);
-    char aux[MAX_STRING_SIZE];
-    if (result == NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", keys[i]);
-    } else {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,%s)", keys[i], result);
-    }
-    write_str(fd, aux);
-    free(result);
+int kvs_read(size_t num_pairs, const char *keys[], int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
   }
-  write_str(fd, "]\n");
 
+  char output[KVS_OP_OUTPUT_SIZE(MAX_WRITE_SIZE)];
+  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  read_pairs(num_pairs, keys, output, 1, 1, 0);
   pthread_rwlock_unlock(&kvs_table->tablelock);
+  write_str(fd, output);
   return 0;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+int kvs_delete(size_t num_pairs, const char *keys[], int fd) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
+  char output[KVS_OP_OUTPUT_SIZE(MAX_WRITE_SIZE)];
+  int missing;
   pthread_rwlock_wrlock(&kvs_table->tablelock);
+  delete_pairs(num_pairs, keys, output, 1, 1, &missing, 0);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  write_str(fd, output);
+  return 0;
+}
 
-  int aux = 0;
-  for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
-      if (!aux) {
-        write_str(fd, "[");
-        aux = 1;
-      }
-      char str[MAX_STRING_SIZE];
-      snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", keys[i]);
-      write_str(fd, str);
-    }
+int kvs_lock(int exclusive) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
   }
-  if (aux) {
-    write_str(fd, "]\n");
+
+  if (exclusive) {
+    pthread_rwlock_wrlock(&kvs_table->tablelock);
+  } else {
+    pthread_rwlock_rdlock(&kvs_table->tablelock);
   }
+  return 0;
+}
 
+void kvs_unlock() {
   pthread_rwlock_unlock(&kvs_table->tablelock);
+}
+
+// Applies an operation.
+// @param missing Whether a missing key of a DELETE was already reported.
+// @param concurrent Whether other operations are applied at the same time.
+// @return Size of the output.
+static size_t apply_op(const kvs_op_t *op, char *output, int *missing,
+                       int concurrent) {
+  switch (op->cmd) {
+  case CMD_WRITE:
+    write_pairs(op->num_pairs, op->keys, op->values, concurrent);
+    break;
+  case CMD_READ:
+    return read_pairs(op->num_pairs, op->keys, output, op->first, op->last,
+                      concurrent);
+  case CMD_DELETE:
+    return delete_pairs(op->num_pairs, op->keys, output, op->first, op->last,
+                        missing, concurrent);
+  case CMD_SHOW:
+  case CMD_WAIT:
+  case CMD_BACKUP:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    break;
+  }
+  output[0] = '\0';
   return 0;
 }
 
+void kvs_apply(size_t num_ops, const kvs_op_t ops[], int fd) {
+  char output[KVS_OP_OUTPUT_SIZE(MAX_WRITE_SIZE)];
+  for (size_t i = 0; i < num_ops; i++) {
+    if (apply_op(&ops[i], output, ops[i].missing, 0) > 0) {
+      write_str(fd, output);
+    }
+  }
+}
+
+size_t kvs_apply_concurrent(const kvs_op_t *op, char *output) {
+  int missing;
+  return apply_op(op, output, &missing, 1);
+}
+
 void kvs_show(int fd) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
@@ -137,43 +297,216 @@ void kvs_show(int fd) {
   pthread_rwlock_unlock(&kvs_table->tablelock);
 }
 
+// Writes the pairs of buckets [first, last) to a backup file, starting at the
+// given offset. Async signal safe.
+// @param bck_name Backup file, which must already exist.
+// @param buffer Output buffer with BACKUP_BUFFER_SIZE bytes.
+// @param compressed Buffer for compressed blocks, NULL to write plain text.
+// @param first First bucket to write.
+// @param last Bucket after the last one to write.
+// @param offset Position in the file of the first pair.
+// @return 0 if successful, 1 otherwise.
+static int backup_write_buckets(const char *bck_name, char *buffer,
+                                char *compressed, int first, int last,
+                                off_t offset) {
+  int fd = open(bck_name, O_WRONLY);
+  if (fd < 0 || lseek(fd, offset, SEEK_SET) < 0) {
+    return 1;
+  }
+
+  write_buffer_t wb = {fd, buffer, BACKUP_BUFFER_SIZE, 0, compressed};
+  for (int i = first; i < last; i++) {
+    KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
+    while (keyNode != NULL) {
+      if (buffer_write_pair(&wb, keyNode->key, keyNode->value) != 0) {
+        close(fd);
+        return 1;
+      }
+      keyNode = keyNode->next; // Move to the next node of the list
+    }
+  }
+
+  int result = buffer_flush(&wb) != 0;
+  close(fd);
+  return result;
+}
+
+// Writes the whole table to a backup file. Big tables are split in bucket
+// ranges of similar size in bytes, each written by its own process at its
+// precomputed offset, so the file is the same as if written sequentially.
+// Compressed backups are always written sequentially, since the size of
+// each range is only known after compressing it.
+// Async signal safe, meant to run in the backup process.
+// @param bck_name Path of the backup file, created empty by kvs_backup.
+// @param buffer Output buffer with BACKUP_BUFFER_SIZE bytes, followed by
+// COMPRESS_BOUND(BACKUP_BUFFER_SIZE) bytes if BACKUP_COMPRESSION is set.
+// @return 0 if successful, 1 otherwise.
+static int backup_write(const char *bck_name, char *buffer) {
+  int fd = open(bck_name, O_WRONLY);
+  if (fd < 0) {
+    return 1;
+  }
+
+  if (BACKUP_COMPRESSION) {
+    int failed = write(fd, COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE) !=
+                 COMPRESS_MAGIC_SIZE;
+    close(fd);
+    if (failed) {
+      return 1;
+    }
+    return backup_write_buckets(bck_name, buffer, buffer + BACKUP_BUFFER_SIZE,
+                                0, TABLE_SIZE, COMPRESS_MAGIC_SIZE);
+  }
+  close(fd);
+
+  size_t bucket_bytes[TABLE_SIZE];
+  size_t total = 0;
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    bucket_bytes[i] = 0;
+    for (KeyNode *keyNode = kvs_table->table[i]; keyNode != NULL;
+         keyNode = keyNode->next) {
+      // "(" + key + ", " + value + ")\n"
+      bucket_bytes[i] += strlen(keyNode->key) + strlen(keyNode->value) + 5;
+    }
+    total += bucket_bytes[i];
+  }
+
+  if (backup_writers <= 1 || total <= BACKUP_PARALLEL_MIN_SIZE) {
+    return backup_write_buckets(bck_name, buffer, NULL, 0, TABLE_SIZE, 0);
+  }
+
+  pid_t writers[BACKUP_WRITERS];
+  int num_writers = 0;
+  int first = 0;
+  size_t offset = 0;
+  int result = 0;
+  while (first < TABLE_SIZE) {
+    // the last range is written by this process, once the others are started
+    size_t target = total / (size_t)backup_writers;
+    int last = first;
+    size_t range_bytes = 0;
+    while (last < TABLE_SIZE &&
+           (range_bytes < target || num_writers == backup_writers - 1)) {
+      range_bytes += bucket_bytes[last++];
+    }
+
+    if (last == TABLE_SIZE) {
+      result = backup_write_buckets(bck_name, buffer, NULL, first, last,
+                                    (off_t)offset);
+      break;
+    }
+
+    // fork is async signal safe, unlike pthread_create
+    pid_t pid = fork();
+    if (pid == 0) {
+      _exit(backup_write_buckets(bck_name, buffer, NULL, first, last,
+                                 (off_t)offset));
+    } else if (pid < 0) {
+      result = backup_write_buckets(bck_name, buffer, NULL, first, last,
+                                    (off_t)offset);
+    } else {
+      writers[num_writers++] = pid;
+    }
+    first = last;
+    offset += range_bytes;
+  }
+
+  for (int i = 0; i < num_writers; i++) {
+    int status;
+    if (waitpid(writers[i], &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      result = 1;
+    }
+  }
+  return result;
+}
+
+// Creates a backup as a hard link to the last one, if the table did not
+// change since it was taken. The last backup is created before its process
+// is forked, so it can be linked even while it is still being written.
+// Must be called with the table locked.
+// @param bck_name Path of the new backup file.
+// @return 0 if the backup was linked, 1 if it has to be written.
+static int link_last_backup(const char *bck_name) {
+  if (last_backup_name[0] == '\0' || last_backup_version != kvs_version) {
+    return 1;
+  }
+  unlink(bck_name);
+  return link(last_backup_name, bck_name) != 0;
+}
+
 int kvs_backup(size_t num_backup, char *job_filename, char *directory) {
   pid_t pid;
-  char bck_name[50];
-  snprintf(bck_name, sizeof(bck_name), "%s/%s-%ld.bck", directory,
-           strtok(job_filename, "."), num_backup);
+  char bck_name[MAX_JOB_FILE_NAME_SIZE];
+  // The job may be in a subdirectory, whose name may have a dot too
+  const char *name = strrchr(job_filename, '/');
+  const char *dot = strrchr(name != NULL ? name : job_filename, '.');
+  int length =
+      dot != NULL ? (int)(dot - job_filename) : (int)strlen(job_filename);
+  snprintf(bck_name, sizeof(bck_name), "%s/%.*s-%ld.bck", directory, length,
+           job_filename, num_backup);
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  pid = fork();
+  // A backup process is a copy of the table, so it is only forked once the
+  // backup scheduler has a slot for it; the table may change while waiting
+  // for one, so whether it can be linked is checked again after
+  int reserved = 0;
+  while (1) {
+    pthread_rwlock_rdlock(&kvs_table->tablelock);
+    pthread_mutex_lock(&last_backup_lock);
+    if (link_last_backup(bck_name) == 0) {
+      pthread_mutex_unlock(&last_backup_lock);
+      pthread_rwlock_unlock(&kvs_table->tablelock);
+      if (reserved) {
+        backup_cancel();
+      }
+      return 0;
+    }
+    if (reserved) {
+      break;
+    }
+    pthread_mutex_unlock(&last_backup_lock);
+    pthread_rwlock_unlock(&kvs_table->tablelock);
+    backup_reserve();
+    reserved = 1;
+  }
+
+  // malloc is not async signal safe, so the buffer has to exist before fork
+  char *buffer = malloc(BACKUP_BUFFER_SIZE +
+                        (BACKUP_COMPRESSION
+                             ? COMPRESS_BOUND(BACKUP_BUFFER_SIZE)
+                             : 0));
+  int fd;
+  // A file left there may be a hard link to other backups (see
+  // link_last_backup), which truncating it would change too
+  unlink(bck_name);
+  if (buffer == NULL ||
+      (fd = open(bck_name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+    pid = -1;
+  } else {
+    close(fd);
+    pid = fork();
+  }
+
+  if (pid > 0) {
+    strncpy(last_backup_name, bck_name, sizeof(last_backup_name) - 1);
+    last_backup_version = kvs_version;
+  }
+  pthread_mutex_unlock(&last_backup_lock);
   pthread_rwlock_unlock(&kvs_table->tablelock);
+
   if (pid == 0) {
     // functions used here have to be async signal safe, since this
     // fork happens in a multi thread context (see man fork)
-    int fd = open(bck_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    for (int i = 0; i < TABLE_SIZE; i++) {
-      KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-      while (keyNode != NULL) {
-        char aux[MAX_STRING_SIZE];
-        aux[0] = '(';
-        size_t num_bytes_copied = 1; // the "("
-        // the - 1 are all to leave space for the '/0'
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, keyNode->key,
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, ", ",
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, keyNode->value,
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, ")\n",
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        aux[num_bytes_copied] = '\0';
-        write_str(fd, aux);
-        keyNode = keyNode->next; // Move to the next node of the list
-      }
-    }
-    exit(1);
-  } else if (pid < 0) {
+    backup_close_fds();
+    _exit(backup_write(bck_name, buffer));
+  }
+
+  free(buffer);
+  if (pid < 0) {
+    backup_cancel();
     return -1;
   }
+  backup_started(pid);
   return 0;
 }
 
@@ -183,8 +516,15 @@ void kvs_wait(unsigned int delay_ms) {
 }
 
 int checkKey(const char *key){
-  if(read_pair(kvs_table,key)==NULL)
-    return 1;
-  else
-    return 0;
+  if (hash(key) < 0) {
+    return 1; // could not be in the table
+  }
+  // Jobs may change the table meanwhile, some with only their buckets locked
+  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  lock_bucket(key, 1, 0);
+  char *value = read_pair(kvs_table, key);
+  unlock_bucket(key, 1);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  free(value);
+  return value == NULL;
 }
@@ -4,6 +4,23 @@
 #include <stddef.h>
 
 #include "constants.h"
+#include "parser.h"
+
+/// A WRITE, READ or DELETE, as given to kvs_write, kvs_read or kvs_delete,
+/// or a chunk of one too big to parse at once.
+typedef struct {
+  enum Command cmd;
+  size_t num_pairs;
+  const char **keys;
+  const char **values; // WRITE only
+  int first;           // first chunk of its command
+  int last;            // last chunk of its command
+  int *missing;        // DELETE only, kept between the chunks of a command
+} kvs_op_t;
+
+/// Most output of a kvs_op_t with num_pairs keys, including its '\0': "[", a
+/// "(key,value)" of at most MAX_STRING_SIZE - 1 bytes per key and "]\n".
+#define KVS_OP_OUTPUT_SIZE(num_pairs) ((num_pairs) * (MAX_STRING_SIZE - 1) + 4)
 
 /// Initializes the KVS state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
@@ -18,21 +35,47 @@ int kvs_terminate();
 /// @param keys Array of keys' strings.
 /// @param values Array of values' strings.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]);
+int kvs_write(size_t num_pairs, const char *keys[], const char *values[]);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
 /// @param fd File descriptor to write the (successful) output.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_read(size_t num_pairs, const char *keys[], int fd);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_delete(size_t num_pairs, const char *keys[], int fd);
+
+/// Locks the table, to apply several operations with kvs_apply.
+/// @param exclusive Whether an operation will change the table.
+/// @return 0 if the table was locked, 1 otherwise.
+int kvs_lock(int exclusive);
+
+/// Unlocks the table locked by kvs_lock.
+void kvs_unlock();
+
+/// Applies several operations in order. The table must be locked by kvs_lock,
+/// exclusively unless all operations are READs.
+/// @param num_ops Number of operations.
+/// @param ops Operations to apply.
+/// @param fd File descriptor to write the output of READ and DELETE.
+void kvs_apply(size_t num_ops, const kvs_op_t ops[], int fd);
+
+/// Applies a whole command (its first and last chunk) while other threads
+/// apply other commands of the same batch, or requests of other sessions,
+/// keeping its output in memory.
+/// The table must be locked by kvs_lock as for kvs_apply, and commands applied
+/// at the same time may not have a key in common, unless all of them only
+/// read it.
+/// @param op Operation to apply.
+/// @param output Buffer of KVS_OP_OUTPUT_SIZE(op->num_pairs) bytes for the
+/// output.
+/// @return Size of the output, which is then a string.
+size_t kvs_apply_concurrent(const kvs_op_t *op, char *output);
 
 /// Writes the state of the KVS.
 /// @param fd File descriptor to write the output.
@@ -40,7 +83,7 @@ void kvs_show(int fd);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
 /// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
+/// @return 0 if the backup was successful, -1 otherwise.
 int kvs_backup(size_t num_backup, char *job_filename, char *directory);
 
 /// Waits for the last backup to be called.
@@ -0,0 +1,320 @@
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "io.h"
+#include "kvs.h"
+
+// The operations of a batch form a DAG: each depends on the earlier ones it
+// has a key in common with, unless both only read it. A WRITE also depends on
+// the earlier WRITEs to the same bucket, since new keys are put at the start
+// of their bucket and SHOW and BACKUP list them in that order.
+// An operation's level is one more than the highest level of the operations
+// it depends on, so the operations of a level can be applied at the same time
+// once every level before it is done. Their outputs are kept apart and
+// written in order.
+
+typedef struct batch_t batch_t;
+
+// Operations order[first..last) of a batch, applied by a single thread.
+typedef struct task_t {
+  batch_t *batch;
+  size_t first;
+  size_t last;
+  struct task_t *next;
+} task_t;
+
+struct batch_t {
+  const kvs_op_t *ops;
+  size_t *order;   // operations by level
+  size_t *offsets; // where each operation's output is in output
+  size_t *sizes;   // size of each operation's output
+  char *output;
+  size_t pending;  // tasks of the level being applied that are not done
+};
+
+// Level after the last operation that wrote a key, and after the last one
+// that read it, 0 if there was none.
+typedef struct {
+  const char *key;
+  size_t written;
+  size_t read;
+} key_levels_t;
+
+static struct {
+  pthread_t threads[PARALLEL_WORKERS];
+  size_t num_threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t queued; // a task was queued, or terminate was set
+  pthread_cond_t done;   // a batch has no tasks pending
+  task_t *head;
+  task_t *tail;
+  int terminate;
+} pool = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+          .queued = PTHREAD_COND_INITIALIZER,
+          .done = PTHREAD_COND_INITIALIZER};
+
+static void run_task(const task_t *task) {
+  batch_t *batch = task->batch;
+  for (size_t i = task->first; i < task->last; i++) {
+    size_t op = batch->order[i];
+    batch->sizes[op] = kvs_apply_concurrent(&batch->ops[op],
+                                            batch->output + batch->offsets[op]);
+  }
+}
+
+// Takes the oldest task queued and applies it.
+// Must be called with pool.mutex locked, which is unlocked meanwhile.
+static void run_queued() {
+  task_t *task = pool.head;
+  pool.head = task->next;
+  if (pool.head == NULL) {
+    pool.tail = NULL;
+  }
+
+  pthread_mutex_unlock(&pool.mutex);
+  run_task(task);
+  pthread_mutex_lock(&pool.mutex);
+
+  // The batch may be gone as soon as the mutex is unlocked
+  if (--task->batch->pending == 0) {
+    pthread_cond_broadcast(&pool.done);
+  }
+}
+
+static void *worker_thread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&pool.mutex);
+  while (1) {
+    while (pool.head == NULL && !pool.terminate) {
+      pthread_cond_wait(&pool.queued, &pool.mutex);
+    }
+    if (pool.head == NULL) {
+      break;
+    }
+    run_queued();
+  }
+  pthread_mutex_unlock(&pool.mutex);
+  return NULL;
+}
+
+int parallel_init() {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > PARALLEL_WORKERS) {
+    cpus = PARALLEL_WORKERS;
+  }
+  // The thread of the job applies commands too
+  size_t num_threads = cpus > 1 ? (size_t)cpus - 1 : 0;
+
+  pool.terminate = 0;
+  for (pool.num_threads = 0; pool.num_threads < num_threads;
+       pool.num_threads++) {
+    if (pthread_create(&pool.threads[pool.num_threads], NULL, worker_thread,
+                       NULL) != 0) {
+      fprintf(stderr, "Failed to create parallel worker thread\n");
+      parallel_terminate();
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void parallel_terminate() {
+  pthread_mutex_lock(&pool.mutex);
+  pool.terminate = 1;
+  pthread_cond_broadcast(&pool.queued);
+  pthread_mutex_unlock(&pool.mutex);
+
+  for (size_t i = 0; i < pool.num_threads; i++) {
+    pthread_join(pool.threads[i], NULL);
+  }
+  pool.num_threads = 0;
+}
+
+// Finds a key, adding it if it is not there yet.
+// @param map Open addressing table with a power of 2 entries, never full.
+// @param mask Number of entries minus 1.
+static key_levels_t *find_key(key_levels_t *map, size_t mask,
+                              const char *key) {
+  uint64_t fnv = 14695981039346656037ULL; // FNV-1a
+  for (const char *c = key; *c != '\0'; c++) {
+    fnv = (fnv ^ (unsigned char)*c) * 1099511628211ULL;
+  }
+
+  size_t i = (size_t)fnv & mask;
+  while (map[i].key != NULL && strcmp(map[i].key, key) != 0) {
+    i = (i + 1) & mask;
+  }
+  if (map[i].key == NULL) {
+    map[i].key = key;
+  }
+  return &map[i];
+}
+
+// Gets the level of an operation, from the levels of its keys and buckets so
+// far, and updates them.
+// @param buckets Level after the last WRITE to each bucket, 0 if none.
+static size_t op_level(key_levels_t *map, size_t mask, size_t *buckets,
+                       const kvs_op_t *op) {
+  int writes = op->cmd != CMD_READ;
+  size_t level = 0;
+  for (size_t i = 0; i < op->num_pairs; i++) {
+    key_levels_t *key = find_key(map, mask, op->keys[i]);
+    if (key->written > level) {
+      level = key->written;
+    }
+    if (writes && key->read > level) {
+      level = key->read;
+    }
+    int bucket = hash(op->keys[i]);
+    if (op->cmd == CMD_WRITE && bucket >= 0 && buckets[bucket] > level) {
+      level = buckets[bucket];
+    }
+  }
+
+  for (size_t i = 0; i < op->num_pairs; i++) {
+    key_levels_t *key = find_key(map, mask, op->keys[i]);
+    if (writes) {
+      key->written = level + 1;
+    } else if (key->read < level + 1) {
+      key->read = level + 1;
+    }
+    int bucket = hash(op->keys[i]);
+    if (op->cmd == CMD_WRITE && bucket >= 0) {
+      buckets[bucket] = level + 1;
+    }
+  }
+  return level;
+}
+
+// Applies the operations order[first..last) of a batch, all of the same
+// level, split in a task per thread of similar number of keys.
+static void apply_level(batch_t *batch, size_t first, size_t last) {
+  size_t keys = 0;
+  for (size_t i = first; i < last; i++) {
+    keys += batch->ops[batch->order[i]].num_pairs + 1;
+  }
+
+  task_t tasks[PARALLEL_WORKERS];
+  size_t num_tasks = 0;
+  size_t target = keys / (pool.num_threads + 1) + 1;
+  size_t start = first;
+  while (start < last) {
+    size_t end = start;
+    size_t task_keys = 0;
+    while (end < last &&
+           (task_keys < target || num_tasks == pool.num_threads)) {
+      task_keys += batch->ops[batch->order[end++]].num_pairs + 1;
+    }
+    tasks[num_tasks++] = (task_t){batch, start, end, NULL};
+    start = end;
+  }
+
+  if (num_tasks > 1) {
+    pthread_mutex_lock(&pool.mutex);
+    batch->pending = num_tasks - 1;
+    for (size_t i = 1; i < num_tasks; i++) {
+      if (pool.tail == NULL) {
+        pool.head = &tasks[i];
+      } else {
+        pool.tail->next = &tasks[i];
+      }
+      pool.tail = &tasks[i];
+    }
+    pthread_cond_broadcast(&pool.queued);
+    pthread_mutex_unlock(&pool.mutex);
+  }
+
+  run_task(&tasks[0]);
+
+  if (num_tasks > 1) {
+    // Helps with whatever is queued until the other tasks are done
+    pthread_mutex_lock(&pool.mutex);
+    while (batch->pending > 0) {
+      if (pool.head != NULL) {
+        run_queued();
+      } else {
+        pthread_cond_wait(&pool.done, &pool.mutex);
+      }
+    }
+    pthread_mutex_unlock(&pool.mutex);
+  }
+}
+
+void parallel_apply(size_t num_ops, const kvs_op_t ops[], int fd) {
+  size_t total_keys = 0;
+  size_t total_output = 0;
+  int whole = 1;
+  for (size_t i = 0; i < num_ops; i++) {
+    total_keys += ops[i].num_pairs;
+    total_output += KVS_OP_OUTPUT_SIZE(ops[i].num_pairs);
+    whole = whole && ops[i].first && ops[i].last;
+  }
+  // Chunks of a command share its state, so they are applied in order
+  if (pool.num_threads == 0 || num_ops < 2 || !whole) {
+    kvs_apply(num_ops, ops, fd);
+    return;
+  }
+
+  size_t capacity = 16;
+  while (capacity < 2 * total_keys) {
+    capacity *= 2;
+  }
+  size_t *index = malloc((5 * num_ops + 1) * sizeof(size_t));
+  char *output = malloc(total_output);
+  key_levels_t *map = calloc(capacity, sizeof(key_levels_t));
+  if (index == NULL || output == NULL || map == NULL) {
+    free(index);
+    free(output);
+    free(map);
+    kvs_apply(num_ops, ops, fd);
+    return;
+  }
+
+  batch_t batch = {ops, index + num_ops, index + 2 * num_ops,
+                   index + 3 * num_ops, output, 0};
+  size_t *levels = index;
+  size_t *starts = index + 4 * num_ops; // num_ops + 1 entries
+  memset(starts, 0, (num_ops + 1) * sizeof(size_t));
+  size_t buckets[TABLE_SIZE] = {0};
+  size_t offset = 0;
+  for (size_t i = 0; i < num_ops; i++) {
+    levels[i] = op_level(map, capacity - 1, buckets, &ops[i]);
+    starts[levels[i] + 1]++;
+    batch.offsets[i] = offset;
+    offset += KVS_OP_OUTPUT_SIZE(ops[i].num_pairs);
+  }
+  free(map);
+
+  // Counting sort by level, keeping the order of the job within a level
+  for (size_t level = 0; level < num_ops; level++) {
+    starts[level + 1] += starts[level];
+  }
+  for (size_t i = 0; i < num_ops; i++) {
+    batch.order[starts[levels[i]]++] = i;
+  }
+
+  for (size_t first = 0; first < num_ops;) {
+    size_t last = first + 1;
+    while (last < num_ops &&
+           levels[batch.order[last]] == levels[batch.order[first]]) {
+      last++;
+    }
+    apply_level(&batch, first, last);
+    first = last;
+  }
+
+  for (size_t i = 0; i < num_ops; i++) {
+    if (batch.sizes[i] > 0) {
+      write_str(fd, output + batch.offsets[i]);
+    }
+  }
+  free(index);
+  free(output);
+}
@@ -0,0 +1,26 @@
+#ifndef SERVER_PARALLEL_H
+#define SERVER_PARALLEL_H
+
+#include <stddef.h>
+
+#include "operations.h"
+
+/// @brief Starts the threads that apply the commands of a job in parallel:
+/// one less than the online CPUs, at most PARALLEL_WORKERS - 1. With a single
+/// CPU there are none, and commands are applied in order.
+/// @return 0 if no errors, 1 otherwise
+int parallel_init();
+
+/// @brief Stops the threads started by parallel_init.
+void parallel_terminate();
+
+/// @brief Applies a batch of operations like kvs_apply, with the same output,
+/// but applies at the same time operations that do not depend on each other:
+/// those with no key in common, unless both only read it.
+/// The table must be locked by kvs_lock, as for kvs_apply.
+/// @param num_ops Number of operations.
+/// @param ops Operations to apply.
+/// @param fd File descriptor to write the output of READ and DELETE.
+void parallel_apply(size_t num_ops, const kvs_op_t ops[], int fd);
+
+#endif  // SERVER_PARALLEL_H
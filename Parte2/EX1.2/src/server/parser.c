@@ -11,79 +11,338 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "constants.h"
 #include "io.h"
 
-// Reads a string and indicates the position from where it was
-// extracted, based on the KVS specification.
-// @param fd File to read from.
-// @param buffer To write the string in.
-// @param max Maximum string size.
-static int read_string(int fd, char *buffer, size_t max) {
+int job_reader_init(job_reader_t *reader, int fd) {
+  reader->fd = fd;
+  reader->pos = 0;
+  reader->len = 0;
+  reader->buffers = malloc(sizeof(job_buffer_t));
+  if (reader->buffers == NULL) {
+    return 1;
+  }
+  reader->buffers->refs = 0;
+  reader->buffers->next = NULL;
+  reader->current = reader->buffers;
+  reader->buffer = reader->current->data;
+  return 0;
+}
+
+void job_reader_destroy(job_reader_t *reader) {
+  while (reader->buffers != NULL) {
+    job_buffer_t *next = reader->buffers->next;
+    free(reader->buffers);
+    reader->buffers = next;
+  }
+}
+
+job_buffer_t *job_reader_hold(job_reader_t *reader) {
+  __atomic_fetch_add(&reader->current->refs, 1, __ATOMIC_RELAXED);
+  return reader->current;
+}
+
+void job_buffer_release(job_buffer_t *buffer) {
+  // The strings are no longer read once the reader sees it released
+  __atomic_fetch_sub(&buffer->refs, 1, __ATOMIC_RELEASE);
+}
+
+// Makes the reader's buffer safe to write over, moving its unread bytes to
+// the start of another buffer if strings sliced out of it are held.
+// @param reader Reader to write to.
+// @return 0 if no errors, 1 if no buffer could be allocated.
+static int unhold(job_reader_t *reader) {
+  if (__atomic_load_n(&reader->current->refs, __ATOMIC_ACQUIRE) == 0) {
+    return 0;
+  }
+
+  job_buffer_t *free_buffer = reader->buffers;
+  while (free_buffer != NULL &&
+         __atomic_load_n(&free_buffer->refs, __ATOMIC_ACQUIRE) != 0) {
+    free_buffer = free_buffer->next;
+  }
+  if (free_buffer == NULL) {
+    free_buffer = malloc(sizeof(job_buffer_t));
+    if (free_buffer == NULL) {
+      write_str(STDERR_FILENO, "Failed to allocate parser buffer\n");
+      return 1;
+    }
+    free_buffer->refs = 0;
+    free_buffer->next = reader->buffers;
+    reader->buffers = free_buffer;
+  }
+
+  memcpy(free_buffer->data, reader->buffer + reader->pos,
+         reader->len - reader->pos);
+  reader->len -= reader->pos;
+  reader->pos = 0;
+  reader->current = free_buffer;
+  reader->buffer = free_buffer->data;
+  return 0;
+}
+
+// Refills the reader's buffer from its file descriptor.
+// @param reader Reader with no unread bytes left.
+// @return Number of bytes now available, 0 on end of file or error.
+static size_t refill(job_reader_t *reader) {
+  if (unhold(reader) != 0) {
+    return 0;
+  }
+
   ssize_t bytes_read;
-  char ch;
-  size_t i = 0;
-  int value = -1;
+  do {
+    bytes_read = read(reader->fd, reader->buffer, PARSER_BUFFER_SIZE);
+  } while (bytes_read < 0 && errno == EINTR);
 
-  while (i < max) {
-    bytes_read = read(fd, &ch, 1);
+  reader->pos = 0;
+  reader->len = bytes_read > 0 ? (size_t)bytes_read : 0;
+  return reader->len;
+}
 
-    if (bytes_read <= 0) {
-      return -1;
+// Reads one character, the buffered equivalent of read(fd, ch, 1).
+// @param reader Reader to read from.
+// @param ch Where to store the character.
+// @return 1 if a character was read, 0 on end of file.
+static inline int read_char(job_reader_t *reader, char *ch) {
+  if (reader->pos == reader->len && refill(reader) == 0) {
+    return 0;
+  }
+  *ch = reader->buffer[reader->pos++];
+  return 1;
+}
+
+// Reads up to count characters, the buffered equivalent of
+// read(fd, buf, count) on a regular file.
+// @param reader Reader to read from.
+// @param buf Where to store the characters.
+// @param count Number of characters to read.
+// @return Number of characters read, less than count only at end of file.
+static size_t read_chars(job_reader_t *reader, char *buf, size_t count) {
+  size_t i = 0;
+  while (i < count && read_char(reader, buf + i) == 1) {
+    i++;
+  }
+  return i;
+}
+
+size_t job_reader_read(job_reader_t *reader, void *buf, size_t count) {
+  char *out = (char *)buf;
+  size_t done = 0;
+  while (done < count) {
+    if (reader->pos == reader->len && refill(reader) == 0) {
+      break;
     }
+    size_t available = reader->len - reader->pos;
+    size_t n = count - done < available ? count - done : available;
+    memcpy(out + done, reader->buffer + reader->pos, n);
+    reader->pos += n;
+    done += n;
+  }
+  return done;
+}
 
-    if (ch == ' ') {
-      return -1;
+// Moves the unread bytes to the start of the buffer and reads more after
+// them, so a token split between two reads ends up contiguous.
+// @param reader Reader to read from.
+// @return Number of bytes added, 0 on end of file or error.
+static size_t read_more(job_reader_t *reader) {
+  if (unhold(reader) != 0) {
+    return 0;
+  }
+
+  size_t unread = reader->len - reader->pos;
+  memmove(reader->buffer, reader->buffer + reader->pos, unread);
+  reader->pos = 0;
+  reader->len = unread;
+
+  ssize_t bytes_read;
+  do {
+    bytes_read = read(reader->fd, reader->buffer + unread,
+                      PARSER_BUFFER_SIZE - unread);
+  } while (bytes_read < 0 && errno == EINTR);
+
+  if (bytes_read <= 0) {
+    return 0;
+  }
+  reader->len += (size_t)bytes_read;
+  return (size_t)bytes_read;
+}
+
+// Makes sure count bytes are buffered past the current position, or as many
+// as the file has left, so tokens parsed afterwards can be sliced out of the
+// buffer without it moving under them.
+// @param reader Reader to read from.
+// @param count Number of bytes wanted, capped at the buffer size.
+static void reserve(job_reader_t *reader, size_t count) {
+  if (count > PARSER_BUFFER_SIZE) {
+    count = PARSER_BUFFER_SIZE;
+  }
+  while (reader->len - reader->pos < count && read_more(reader) > 0) {
+  }
+}
+
+const char *job_reader_slice(job_reader_t *reader, size_t count) {
+  if (count > PARSER_BUFFER_SIZE) {
+    return NULL;
+  }
+  reserve(reader, count);
+  if (reader->len - reader->pos < count) {
+    reader->pos = reader->len;
+    return NULL;
+  }
+  const char *slice = reader->buffer + reader->pos;
+  reader->pos += count;
+  return slice;
+}
+
+// Finds the first string delimiter (',', ')', ']' or ' ') in a buffer,
+// 32 or 16 bytes at a time when AVX2 or SSE2 are available.
+// @param str Buffer to search.
+// @param len Number of bytes to search.
+// @return Index of the delimiter, len if there is none.
+static size_t find_delimiter(const char *str, size_t len) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i comma = _mm256_set1_epi8(',');
+  const __m256i paren = _mm256_set1_epi8(')');
+  const __m256i bracket = _mm256_set1_epi8(']');
+  const __m256i space = _mm256_set1_epi8(' ');
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(str + i));
+    __m256i found = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, comma),
+                        _mm256_cmpeq_epi8(chunk, paren)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, bracket),
+                        _mm256_cmpeq_epi8(chunk, space)));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(found);
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
     }
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i comma16 = _mm_set1_epi8(',');
+  const __m128i paren16 = _mm_set1_epi8(')');
+  const __m128i bracket16 = _mm_set1_epi8(']');
+  const __m128i space16 = _mm_set1_epi8(' ');
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+    __m128i found =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, comma16),
+                                  _mm_cmpeq_epi8(chunk, paren16)),
+                     _mm_or_si128(_mm_cmpeq_epi8(chunk, bracket16),
+                                  _mm_cmpeq_epi8(chunk, space16)));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(found);
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < len; i++) {
+    char ch = str[i];
+    if (ch == ',' || ch == ')' || ch == ']' || ch == ' ') {
+      return i;
+    }
+  }
+  return len;
+}
 
-    if (ch == ',') {
-      value = 0;
-      break;
-    } else if (ch == ')') {
-      value = 1;
-      break;
-    } else if (ch == ']') {
-      value = 2;
+// Reads a string and indicates the position from where it was
+// extracted, based on the KVS specification.
+// The string is terminated in place, over its delimiter, and left in the
+// reader's buffer.
+// @param reader File to read from.
+// @param str Where to store a pointer to the string.
+// @param max Maximum string size.
+static int read_string(job_reader_t *reader, const char **str, size_t max) {
+  // At most max characters are consumed, the delimiter included
+  size_t window;
+  size_t index;
+  while (1) {
+    window = reader->len - reader->pos;
+    if (window > max) {
+      window = max;
+    }
+    index = find_delimiter(reader->buffer + reader->pos, window);
+    if (index < window || window == max) {
       break;
     }
+    if (read_more(reader) == 0) {
+      // the string is not terminated before the end of the file
+      reader->pos = reader->len;
+      return -1;
+    }
+  }
 
-    buffer[i++] = ch;
+  char *start = reader->buffer + reader->pos;
+  if (index == window) {
+    reader->pos += window;
+    return -1;
+  }
+  reader->pos += index + 1;
+
+  int value;
+  switch (start[index]) {
+  case ',':
+    value = 0;
+    break;
+  case ')':
+    value = 1;
+    break;
+  case ']':
+    value = 2;
+    break;
+  default: // ' '
+    return -1;
   }
 
-  buffer[i] = '\0';
+  start[index] = '\0';
+  *str = start;
 
   return value;
 }
 
 // Reads a number and stores it in an unsigned integer
 // variable.
-// @param fd File to read from.
+// @param reader File to read from.
 // @param value To store the number in.
 // @param next Will point to the character succeding the number.
-static int read_uint(int fd, unsigned int *value, char *next) {
+static int read_uint(job_reader_t *reader, unsigned int *value, char *next) {
   char buf[16];
+  char ch;
+  int overflow = 0;
 
   int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (read_char(reader, &ch) == 0) {
       *next = '\0';
       break;
     }
 
-    *next = buf[i];
+    *next = ch;
 
-    if (buf[i] > '9' || buf[i] < '0') {
-      buf[i] = '\0';
+    if (ch > '9' || ch < '0') {
       break;
     }
 
-    i++;
+    // more digits than fit in buf are already bigger than UINT_MAX
+    if (i == (int)sizeof(buf) - 1) {
+      overflow = 1;
+    } else {
+      buf[i++] = ch;
+    }
   }
+  buf[i] = '\0';
 
   unsigned long ul = strtoul(buf, NULL, 10);
 
-  if (ul > UINT_MAX) {
+  if (overflow || ul > UINT_MAX) {
     return 1;
   }
 
@@ -92,25 +351,34 @@ static int read_uint(int fd, unsigned int *value, char *next) {
   return 0;
 }
 
-// Jumps file descriptor to next line.
-// @param fd File descriptor.
-static void cleanup(int fd) {
-  char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
-    ;
+// Jumps reader to next line.
+// @param reader File to read from.
+static void cleanup(job_reader_t *reader) {
+  while (1) {
+    if (reader->pos == reader->len && refill(reader) == 0) {
+      return;
+    }
+    char *newline = memchr(reader->buffer + reader->pos, '\n',
+                           reader->len - reader->pos);
+    if (newline != NULL) {
+      reader->pos = (size_t)(newline - reader->buffer) + 1;
+      return;
+    }
+    reader->pos = reader->len;
+  }
 }
 
-enum Command get_next(int fd) {
+enum Command get_next(job_reader_t *reader) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (read_char(reader, buf) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
   case 'W':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-      if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
-        cleanup(fd);
+    if (read_chars(reader, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+      if (read_chars(reader, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
+        cleanup(reader);
         return CMD_INVALID;
       }
       return CMD_WRITE;
@@ -119,196 +387,208 @@ enum Command get_next(int fd) {
     return CMD_WAIT;
 
   case 'R':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
-      cleanup(fd);
+    if (read_chars(reader, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_READ;
 
   case 'D':
-    if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
-      cleanup(fd);
+    if (read_chars(reader, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_DELETE;
 
   case 'S':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
-      cleanup(fd);
+    if (read_chars(reader, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-      cleanup(fd);
+    if (read_chars(reader, buf + 4, 1) != 0 && buf[4] != '\n') {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_SHOW;
 
   case 'B':
-    if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
-      cleanup(fd);
+    if (read_chars(reader, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
-      cleanup(fd);
+    if (read_chars(reader, buf + 6, 1) != 0 && buf[6] != '\n') {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_BACKUP;
 
   case 'H':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
-      cleanup(fd);
+    if (read_chars(reader, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-      cleanup(fd);
+    if (read_chars(reader, buf + 4, 1) != 0 && buf[4] != '\n') {
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_HELP;
 
   case '#':
-    cleanup(fd);
+    cleanup(reader);
     return CMD_EMPTY;
 
   case '\n':
     return CMD_EMPTY;
 
   default:
-    cleanup(fd);
+    cleanup(reader);
     return CMD_INVALID;
   }
 }
 
 // Parses a key value pair.
-// @param fd File decriptor to read from.
+// @param reader File to read from.
 // @param key Pointer where the key will be stored
 // @param value Pointer where the value will be stored
 // @return 1 if successful, 0 otherwise.
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
-    cleanup(fd);
+static int parse_pair(job_reader_t *reader, const char **key,
+                      const char **value) {
+  if (read_string(reader, key, MAX_STRING_SIZE) != 0) {
+    cleanup(reader);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
-    cleanup(fd);
+  if (read_string(reader, value, MAX_STRING_SIZE) != 1) {
+    cleanup(reader);
     return 0;
   }
 
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
-                   char values[][MAX_STRING_SIZE], size_t max_pairs,
-                   size_t max_string_size) {
+size_t parse_write(job_reader_t *reader, const char *keys[],
+                   const char *values[], size_t max_pairs,
+                   size_t max_string_size, int *more) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
-    return 0;
-  }
+  // '[', then up to max_pairs of "(key,value)", then "]\n"
+  reserve(reader, max_pairs * (2 * max_string_size + 1) + 3);
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
-    cleanup(fd);
-    return 0;
+  // A chunk that continues a command starts right after the '(' of its
+  // first pair, which the previous chunk read
+  if (!*more) {
+    if (read_char(reader, &ch) != 1 || ch != '[') {
+      cleanup(reader);
+      return 0;
+    }
+
+    if (read_char(reader, &ch) != 1 || ch != '(') {
+      cleanup(reader);
+      return 0;
+    }
   }
 
   size_t num_pairs = 0;
-  char key[max_string_size];
-  char value[max_string_size];
-  while (num_pairs < max_pairs) {
-    if (parse_pair(fd, key, value) == 0) {
-      cleanup(fd);
+  while (1) {
+    if (parse_pair(reader, &keys[num_pairs], &values[num_pairs]) == 0) {
+      cleanup(reader);
       return 0;
     }
+    num_pairs++;
 
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
-
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
-      cleanup(fd);
+    if (read_char(reader, &ch) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(reader);
       return 0;
     }
 
     if (ch == ']') {
       break;
     }
-  }
 
-  if (num_pairs == max_pairs) {
-    cleanup(fd);
-    return 0;
+    if (num_pairs == max_pairs) {
+      *more = 1;
+      return num_pairs;
+    }
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  *more = 0;
+  if (read_char(reader, &ch) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(reader);
     return 0;
   }
 
   return num_pairs;
 }
 
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
-                         size_t max_string_size) {
+size_t parse_read_delete(job_reader_t *reader, const char *keys[],
+                         size_t max_keys, size_t max_string_size, int *more) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
-    return 0;
+  // '[', then up to max_keys of "key,", then '\n'
+  reserve(reader, max_keys * max_string_size + 2);
+
+  // A chunk that continues a command starts at its first key, right after
+  // the ',' the previous chunk read
+  if (!*more) {
+    if (read_char(reader, &ch) != 1 || ch != '[') {
+      cleanup(reader);
+      return 0;
+    }
   }
 
   size_t num_keys = 0;
-  char key[max_string_size];
-  while (num_keys < max_keys) {
-    int output = read_string(fd, key, max_string_size);
+  while (1) {
+    int output = read_string(reader, &keys[num_keys], max_string_size);
     if (output < 0 || output == 1) {
-      cleanup(fd);
+      cleanup(reader);
       return 0;
     }
-
-    strcpy(keys[num_keys++], key);
+    num_keys++;
 
     if (output == 2) {
       break;
     }
-  }
 
-  if (num_keys == max_keys) {
-    cleanup(fd);
-    return 0;
+    if (num_keys == max_keys) {
+      *more = 1;
+      return num_keys;
+    }
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  *more = 0;
+  if (read_char(reader, &ch) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(reader);
     return 0;
   }
 
   return num_keys;
 }
 
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
+int parse_wait(job_reader_t *reader, unsigned int *delay,
+               unsigned int *thread_id) {
   char ch;
 
-  if (read_uint(fd, delay, &ch) != 0) {
-    cleanup(fd);
+  if (read_uint(reader, delay, &ch) != 0) {
+    cleanup(reader);
     return -1;
   }
 
   if (ch == ' ') {
     if (thread_id == NULL) {
-      cleanup(fd);
+      cleanup(reader);
       return 0;
     }
 
-    if (read_uint(fd, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-      cleanup(fd);
+    if (read_uint(reader, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+      cleanup(reader);
       return -1;
     }
 
@@ -316,7 +596,7 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   } else if (ch == '\n' || ch == '\0') {
     return 0;
   } else {
-    cleanup(fd);
+    cleanup(reader);
     return -1;
   }
 }
@@ -1,10 +1,14 @@
 #ifndef KVS_PARSER_H
 #define KVS_PARSER_H
 
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "constants.h"
 #include "../common/constants.h"
+#include "../common/ring.h"
 
 enum Command {
   CMD_WRITE,
@@ -19,51 +23,147 @@ enum Command {
   EOC // End of commands
 };
 
+/// Keys subscribed by a logical channel of a session (see protocol.h), ""
+/// where there is none.
+typedef struct {
+  uint16_t channel;
+  char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE];
+} subscriptions_t;
+
 typedef struct {
   int id;
   char request_pipe[MAX_PIPE_PATH_LENGTH];
   char response_pipe[MAX_PIPE_PATH_LENGTH];
   char noti_pipe[MAX_PIPE_PATH_LENGTH];
-  char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE];
-  int num_keys;
+  // Shared memory offered by the client, "" if none
+  char shm_name[MAX_PIPE_PATH_LENGTH];
+  // Mapped from shm_name, carrying the requests and responses in place of
+  // the request and response pipes, NULL if they carry them
+  shm_channel_t *channel;
+  // Open from the connect until the session ends
+  int request_fd;
+  int response_fd;
+  int noti_fd;
+  // The three are the same Unix socket (see SOCKET_TRANSPORT), not pipes
+  int socket;
+  // Held to write to the response or notification pipe, which are written by
+  // the jobs' threads too if they are the same socket
+  pthread_mutex_t send_lock;
+  // Where the responses to the requests being served are gathered, to be sent
+  // at once, NULL if each is sent as it is served
+  struct message_batch *replies; // see ../common/io.h
+  // Of each channel subscribing any key, allocated with malloc
+  subscriptions_t *subscriptions;
+  size_t num_subscriptions;
+  size_t max_subscriptions;
+  // subscriptions are notified by the jobs' threads
+  pthread_mutex_t keys_lock;
+  // When its last request was served, in seconds of CLOCK_MONOTONIC, to end
+  // it once idle for SESSION_IDLE_TIMEOUT
+  time_t last_active;
+  // Held by the session table and by each thread serving or notifying it,
+  // freed when the last is dropped (see sessions.c)
+  int refs;
 } session_t;
 
-// Parses input from the given file descriptor, according to
+/// A buffer of a job_reader_t. While any string sliced out of it is held, the
+/// reader reads on into another buffer instead of refilling it.
+typedef struct job_buffer {
+  int refs;                // holds taken with job_reader_hold
+  struct job_buffer *next; // in the reader's list of buffers
+  char data[PARSER_BUFFER_SIZE];
+} job_buffer_t;
+
+/// Buffered input of a job file, so the parser does not need a read() per
+/// character.
+typedef struct {
+  int fd;
+  size_t pos;
+  size_t len;
+  char *buffer;          // data of current
+  job_buffer_t *current;
+  job_buffer_t *buffers; // every buffer allocated, current among them
+} job_reader_t;
+
+/// Initializes a reader for a file descriptor. Nothing else should read from
+/// that descriptor while the reader is in use.
+/// @param reader Reader to initialize.
+/// @param fd File descriptor of input.
+/// @return 0 if no errors, 1 otherwise.
+int job_reader_init(job_reader_t *reader, int fd);
+
+/// Frees a reader's buffers, even those still held.
+/// @param reader Reader to destroy.
+void job_reader_destroy(job_reader_t *reader);
+
+/// Keeps the strings parsed so far valid after the reader is used again, until
+/// job_buffer_release.
+/// @param reader Reader the strings were parsed by.
+/// @return The buffer they are in, to release.
+job_buffer_t *job_reader_hold(job_reader_t *reader);
+
+/// Releases a hold taken with job_reader_hold. May be called from another
+/// thread than the reader's.
+/// @param buffer Buffer to release.
+void job_buffer_release(job_buffer_t *buffer);
+
+/// Reads raw bytes in place, as one contiguous slice of the reader's buffer
+/// that stays valid as strings parsed do.
+/// @param reader Reader to read from.
+/// @param count Number of bytes to read, at most PARSER_BUFFER_SIZE.
+/// @return The bytes, NULL if the file ends before count bytes.
+const char *job_reader_slice(job_reader_t *reader, size_t count);
+
+/// Reads raw bytes, for input that is not text.
+/// @param reader Reader to read from.
+/// @param buf Where to store the bytes.
+/// @param count Number of bytes to read.
+/// @return Number of bytes read, less than count only at end of file.
+size_t job_reader_read(job_reader_t *reader, void *buf, size_t count);
+
+// Parses input from the given reader, according to
 // KVS specification.
-// @param fd File descriptor of input.
+// @param reader Reader of the input.
 // @return enum Command Command code.
-enum Command get_next(int fd);
+enum Command get_next(job_reader_t *reader);
 
-/// Parses a WRITE command.
-/// @param fd File descriptor to read from.
+/// Parses a WRITE command, in chunks of at most max_pairs pairs.
+/// The keys and values point into the reader's buffer and stay valid until
+/// the reader is used again, or until released if held (job_reader_hold).
+/// @param reader Reader to read from.
 /// @param keys Array to store the keys
 /// @param values Array to store the values
 /// @param max_pairs Maximum number of pairs it will write.
 /// @param max_string_size Maximum string size allowed.
+/// @param more Set if the command has more pairs, which the next call parses.
+/// Must be 0 when parsing a new command.
 /// @return 0 if the command was not parsed successfully, otherwise return the
 //          of pairs parsed.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
-                   char values[][MAX_STRING_SIZE], size_t max_pairs,
-                   size_t max_string_size);
+size_t parse_write(job_reader_t *reader, const char *keys[],
+                   const char *values[], size_t max_pairs,
+                   size_t max_string_size, int *more);
 
-// Parses a READ or a DELETE command.
-// @param fd File descriptor to read from.
+// Parses a READ or a DELETE command, in chunks of at most max_keys keys.
+// The keys point into the reader's buffer, as with parse_write.
+// @param reader Reader to read from.
 // @param keys Array to store the keys
 // @param max_pairs Maximum number of pairs it will write.
 // @param max_string_size Maximum string size allowed.
+// @param more As with parse_write.
 // @return 0 if the command was not parsed successfully, otherwise return the
 //          of keys parsed
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
-                         size_t max_string_size);
+size_t parse_read_delete(job_reader_t *reader, const char *keys[],
+                         size_t max_keys, size_t max_string_size, int *more);
 
 /// Parses a WAIT command.
-/// @param fd File descriptor to read from.
+/// @param reader Reader to read from.
 /// @param delay Pointer to the variable to store the wait delay in.
 /// @param thread_id Pointer to the variable to store the thread ID in. May not
 /// be set.
 /// @return 0 if no thread was specified, 1 if a thread was specified, -1 on
 /// error.
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
+int parse_wait(job_reader_t *reader, unsigned int *delay,
+               unsigned int *thread_id);
 
 
 
@@ -0,0 +1,237 @@
+#include "pipeline.h"
+
+#include <unistd.h>
+
+#include "io.h"
+#include "jobc.h"
+
+// Parses the next command of a job, with its arguments, or the next chunk of
+// the command being parsed.
+static void parse_command(job_pipeline_t *pipeline, job_command_t *command) {
+  job_reader_t *reader = &pipeline->reader;
+  command->continued = pipeline->more;
+  command->more = 0;
+  command->aborted = 0;
+  command->cmd = pipeline->more ? pipeline->partial : get_next(reader);
+  switch (command->cmd) {
+  case CMD_WRITE:
+    command->num_pairs =
+        parse_write(reader, command->keys, command->values, MAX_WRITE_SIZE,
+                    MAX_STRING_SIZE, &pipeline->more);
+    break;
+
+  case CMD_READ:
+  case CMD_DELETE:
+    command->num_pairs =
+        parse_read_delete(reader, command->keys, MAX_WRITE_SIZE,
+                          MAX_STRING_SIZE, &pipeline->more);
+    break;
+
+  case CMD_WAIT:
+    if (parse_wait(reader, &command->delay, NULL) == -1) {
+      command->cmd = CMD_INVALID;
+    }
+    return;
+
+  case CMD_SHOW:
+  case CMD_BACKUP:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    return;
+  }
+
+  if (command->num_pairs == 0) {
+    pipeline->more = 0;
+    if (command->continued) {
+      // The chunks already parsed still need an end
+      command->aborted = 1;
+    } else {
+      command->cmd = CMD_INVALID;
+    }
+    return;
+  }
+  command->more = pipeline->more;
+  pipeline->partial = command->cmd;
+}
+
+// Gets the next command of the pipeline's job.
+static void next_command(job_pipeline_t *pipeline, job_command_t *command) {
+  if (!pipeline->compiled) {
+    parse_command(pipeline, command);
+  } else if (pipeline->corrupted) {
+    command->cmd = EOC;
+  } else if (jobc_decode(&pipeline->reader, command, &pipeline->more,
+                         &pipeline->partial) != 0) {
+    write_str(STDERR_FILENO, "Compiled job is corrupted\n");
+    // Ended right after what was decoded of it
+    pipeline->corrupted = 1;
+  }
+
+  // Its keys and values are slices of the reader's buffer, which has to
+  // outlive them however far the reader gets meanwhile
+  command->buffer = NULL;
+  if ((command->cmd == CMD_WRITE || command->cmd == CMD_READ ||
+       command->cmd == CMD_DELETE) &&
+      command->num_pairs > 0) {
+    command->buffer = job_reader_hold(&pipeline->reader);
+  }
+}
+
+static void *parser_thread(void *arg) {
+  job_pipeline_t *pipeline = (job_pipeline_t *)arg;
+
+  while (1) {
+    pthread_mutex_lock(&pipeline->mutex);
+    while (pipeline->count == PIPELINE_DEPTH && !pipeline->stop) {
+      pthread_cond_wait(&pipeline->released, &pipeline->mutex);
+    }
+    if (pipeline->stop) {
+      pthread_mutex_unlock(&pipeline->mutex);
+      return NULL;
+    }
+    // The slot after the last parsed command is never read by the executor
+    job_command_t *command =
+        &pipeline->commands[(pipeline->head + pipeline->count) %
+                            PIPELINE_DEPTH];
+    pthread_mutex_unlock(&pipeline->mutex);
+
+    next_command(pipeline, command);
+
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->count++;
+    pipeline->done = command->cmd == EOC;
+    pthread_cond_signal(&pipeline->parsed);
+    pthread_mutex_unlock(&pipeline->mutex);
+
+    if (pipeline->done) {
+      return NULL;
+    }
+  }
+}
+
+int pipeline_start(job_pipeline_t *pipeline, int fd, int compiled) {
+  if (job_reader_init(&pipeline->reader, fd) != 0) {
+    return 1;
+  }
+  pipeline->compiled = compiled;
+  pipeline->head = 0;
+  pipeline->count = 0;
+  pipeline->done = 0;
+  pipeline->more = 0;
+  pipeline->corrupted = 0;
+  pipeline->stop = 0;
+  pipeline->threaded = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+  pipeline->parsing = pipeline->threaded;
+  if (!pipeline->threaded) {
+    return 0;
+  }
+
+  if (pthread_mutex_init(&pipeline->mutex, NULL) != 0) {
+    job_reader_destroy(&pipeline->reader);
+    return 1;
+  }
+  if (pthread_cond_init(&pipeline->parsed, NULL) != 0) {
+    pthread_mutex_destroy(&pipeline->mutex);
+    job_reader_destroy(&pipeline->reader);
+    return 1;
+  }
+  if (pthread_cond_init(&pipeline->released, NULL) != 0) {
+    pthread_cond_destroy(&pipeline->parsed);
+    pthread_mutex_destroy(&pipeline->mutex);
+    job_reader_destroy(&pipeline->reader);
+    return 1;
+  }
+  if (pthread_create(&pipeline->parser, NULL, parser_thread, pipeline) != 0) {
+    pthread_cond_destroy(&pipeline->released);
+    pthread_cond_destroy(&pipeline->parsed);
+    pthread_mutex_destroy(&pipeline->mutex);
+    job_reader_destroy(&pipeline->reader);
+    return 1;
+  }
+  return 0;
+}
+
+void pipeline_pause(job_pipeline_t *pipeline) {
+  if (!pipeline->parsing) {
+    return;
+  }
+
+  pthread_mutex_lock(&pipeline->mutex);
+  pipeline->stop = 1;
+  pthread_cond_signal(&pipeline->released);
+  pthread_mutex_unlock(&pipeline->mutex);
+
+  pthread_join(pipeline->parser, NULL);
+  pipeline->parsing = 0;
+}
+
+void pipeline_resume(job_pipeline_t *pipeline) {
+  if (!pipeline->threaded || pipeline->parsing || pipeline->done) {
+    return;
+  }
+
+  pipeline->stop = 0;
+  // Without the thread the ring is still filled, as with a single CPU
+  pipeline->parsing =
+      pthread_create(&pipeline->parser, NULL, parser_thread, pipeline) == 0;
+}
+
+size_t pipeline_wait(job_pipeline_t *pipeline) {
+  if (!pipeline->parsing) {
+    if (pipeline->count == 0) {
+      // Parse as far ahead as the ring allows, so commands can be batched
+      while (pipeline->count < PIPELINE_DEPTH && !pipeline->done) {
+        job_command_t *command = pipeline_command(pipeline, pipeline->count);
+        next_command(pipeline, command);
+        pipeline->count++;
+        pipeline->done = command->cmd == EOC;
+      }
+    }
+    return pipeline->count;
+  }
+
+  pthread_mutex_lock(&pipeline->mutex);
+  while (pipeline->count == 0) {
+    pthread_cond_wait(&pipeline->parsed, &pipeline->mutex);
+  }
+  size_t count = pipeline->count;
+  pthread_mutex_unlock(&pipeline->mutex);
+  return count;
+}
+
+job_command_t *pipeline_command(job_pipeline_t *pipeline, size_t index) {
+  return &pipeline->commands[(pipeline->head + index) % PIPELINE_DEPTH];
+}
+
+void pipeline_release(job_pipeline_t *pipeline, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    job_command_t *command = pipeline_command(pipeline, i);
+    if (command->buffer != NULL) {
+      job_buffer_release(command->buffer);
+    }
+  }
+
+  if (!pipeline->parsing) {
+    pipeline->head = (pipeline->head + count) % PIPELINE_DEPTH;
+    pipeline->count -= count;
+    return;
+  }
+
+  pthread_mutex_lock(&pipeline->mutex);
+  pipeline->head = (pipeline->head + count) % PIPELINE_DEPTH;
+  pipeline->count -= count;
+  pthread_cond_signal(&pipeline->released);
+  pthread_mutex_unlock(&pipeline->mutex);
+}
+
+void pipeline_stop(job_pipeline_t *pipeline) {
+  pipeline_pause(pipeline);
+  if (pipeline->threaded) {
+    pthread_cond_destroy(&pipeline->released);
+    pthread_cond_destroy(&pipeline->parsed);
+    pthread_mutex_destroy(&pipeline->mutex);
+  }
+  job_reader_destroy(&pipeline->reader);
+}
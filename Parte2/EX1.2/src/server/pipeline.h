@@ -0,0 +1,91 @@
+#ifndef SERVER_PIPELINE_H
+#define SERVER_PIPELINE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "constants.h"
+#include "parser.h"
+
+/// A command parsed ahead of its execution. Its keys and values point into
+/// the reader's buffer, held until the command is released.
+/// A WRITE, READ or DELETE with more than MAX_WRITE_SIZE pairs or keys is
+/// split in chunks, one per command.
+typedef struct {
+  enum Command cmd;    // CMD_INVALID if the arguments did not parse
+  size_t num_pairs;    // WRITE, READ and DELETE
+  int continued;       // chunk after the first of its command
+  int more;            // chunk before the last of its command
+  int aborted;         // last chunk, without pairs, of a command whose next
+                       // chunk did not parse
+  unsigned int delay;  // WAIT
+  const char *keys[MAX_WRITE_SIZE];
+  const char *values[MAX_WRITE_SIZE];
+  job_buffer_t *buffer; // holding the keys and values, NULL if none
+} job_command_t;
+
+/// A job being parsed by its own thread into a ring of at most
+/// PIPELINE_DEPTH commands, while another thread executes them in order.
+/// With a single CPU there is nothing to overlap, so the ring is instead
+/// filled by the executing thread whenever it runs empty, as it is while the
+/// parser thread is paused.
+typedef struct {
+  job_reader_t reader;
+  int compiled; // reader is of a .jobc
+  job_command_t commands[PIPELINE_DEPTH];
+  size_t head;  // oldest command not yet released
+  size_t count; // commands parsed and not yet released
+  int threaded;         // parsed by its own thread while the job runs
+  int parsing;          // that thread is running
+  int done;             // EOC parsed
+  int more;             // the last command parsed has more chunks
+  enum Command partial; // the last command parsed
+  int corrupted;        // the compiled job is, so EOC is parsed next
+  int stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t parsed;
+  pthread_cond_t released;
+  pthread_t parser;
+} job_pipeline_t;
+
+/// @brief Starts parsing a job. The last command parsed is always EOC.
+/// @param pipeline Pipeline to start.
+/// @param fd File descriptor of the job, read only by the pipeline until it
+/// is stopped.
+/// @param compiled Whether fd is of a compiled job (see jobc.h), past its
+/// header, instead of a .job.
+/// @return 0 if no errors, 1 otherwise
+int pipeline_start(job_pipeline_t *pipeline, int fd, int compiled);
+
+/// @brief Stops parsing ahead while the job is put aside, so that only the
+/// jobs running have a parser thread. The commands parsed are kept.
+/// @param pipeline Pipeline to pause.
+void pipeline_pause(job_pipeline_t *pipeline);
+
+/// @brief Parses ahead again once the job runs again.
+/// @param pipeline Pipeline paused.
+void pipeline_resume(job_pipeline_t *pipeline);
+
+/// @brief Waits until at least one command is parsed.
+/// @param pipeline Pipeline to wait on.
+/// @return Number of commands parsed and not yet released, at least 1.
+size_t pipeline_wait(job_pipeline_t *pipeline);
+
+/// @brief Gets a parsed command, in job order.
+/// @param pipeline Pipeline the command was parsed by.
+/// @param index Position after the oldest unreleased command, less than what
+/// pipeline_wait returned.
+/// @return The command.
+job_command_t *pipeline_command(job_pipeline_t *pipeline, size_t index);
+
+/// @brief Releases the oldest commands, so their slots can be parsed into.
+/// @param pipeline Pipeline the commands were parsed by.
+/// @param count Number of commands to release.
+void pipeline_release(job_pipeline_t *pipeline, size_t count);
+
+/// @brief Stops the parser, even if it has not reached the end of the job,
+/// and frees the pipeline's resources.
+/// @param pipeline Pipeline to stop.
+void pipeline_stop(job_pipeline_t *pipeline);
+
+#endif  // SERVER_PIPELINE_H
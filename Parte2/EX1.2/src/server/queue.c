@@ -1,57 +1,171 @@
+// futex has no glibc wrapper, it is called through syscall(), which needs the
+// GNU extensions
+#define _GNU_SOURCE
 #include "queue.h"
 
+#include <limits.h>
+#include <linux/futex.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 queue_t *queue;
 
-int queue_init() {
+int queue_init(size_t capacity) {
   if (queue) return 1;
+  if (capacity == 0)
+    capacity = QUEUE_BUFFER_SIZE;
+  size_t size = 2; // a single cell can not tell full from empty
+  while (size < capacity) {
+    if (size > SIZE_MAX / 2 / sizeof(queue_cell_t))
+      return 1;
+    size *= 2;
+  }
+
   queue = malloc(sizeof(queue_t));
-  if (queue == NULL) 
-    return 1;
-  if (pthread_mutex_init(&queue->mutex, NULL)) 
-    return 1;
-  if (pthread_cond_init(&queue->full, NULL)) 
+  if (queue == NULL)
     return 1;
-  if (pthread_cond_init(&queue->empty, NULL)) 
+  queue->cells = malloc(size * sizeof(queue_cell_t));
+  if (queue->cells == NULL) {
+    free(queue);
+    queue = NULL;
     return 1;
-  queue->session_count = queue->host = queue->worker = 0;
+  }
+  for (size_t i = 0; i < size; i++) {
+    queue->cells[i].sequence = i;
+  }
+  queue->mask = size - 1;
+  queue->enqueue_pos = queue->dequeue_pos = 0;
+  queue->added = queue->removed = 0;
+  queue->consumers_waiting = queue->producers_waiting = 0;
   return 0;
 }
 
 void queue_destroy() {
-  pthread_mutex_destroy(&queue->mutex);
-  pthread_cond_destroy(&queue->full);
-  pthread_cond_destroy(&queue->empty);
+  free(queue->cells);
   free(queue);
   queue = NULL;
 }
 
+// Sleeps until *word is no longer value (or a spurious wake up).
+static void futex_wait(uint32_t *word, uint32_t value) {
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+// Wakes up to count threads sleeping on word.
+static void futex_wake(uint32_t *word, size_t count) {
+  int num = count < INT_MAX ? (int)count : INT_MAX;
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, num, NULL, NULL, 0);
+}
+
+// Adds a session, unless the queue is full.
+// @return 1 if added, 0 if full.
+static int try_enqueue(session_t *session) {
+  size_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+  while (1) {
+    queue_cell_t *cell = &queue->cells[pos & queue->mask];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+    if (diff == 0) {
+      // The cell is free: it is ours once pos is claimed
+      if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->session = session;
+        __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if (diff < 0) {
+      return 0; // not consumed yet since the last lap
+    } else {
+      pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Removes a session, unless the queue is empty.
+// @return The session, NULL if empty.
+static session_t *try_dequeue() {
+  size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+  while (1) {
+    queue_cell_t *cell = &queue->cells[pos & queue->mask];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        session_t *session = cell->session;
+        // Free for the producer of the next lap
+        __atomic_store_n(&cell->sequence, pos + queue->mask + 1,
+                         __ATOMIC_RELEASE);
+        return session;
+      }
+    } else if (diff < 0) {
+      return NULL; // not produced yet
+    } else {
+      pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Tells the threads waiting on the other side that the queue changed.
+// Sequentially consistent with the waiters counting themselves before they
+// try the queue once more, so either they see the change or they are woken
+// up.
+// @param count Most threads to wake up.
+static void signal_change(uint32_t *counter, uint32_t *waiting, size_t count) {
+  __atomic_fetch_add(counter, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) > 0) {
+    futex_wake(counter, count);
+  }
+}
+
 void queue_produce(session_t *session) {
-  pthread_mutex_lock(&queue->mutex);
-  while (queue->session_count == QUEUE_BUFFER_SIZE) 
-    pthread_cond_wait(&queue->full, &queue->mutex);
-  queue->buffer[queue->host] = *session;
-  queue->host++;
-  if (queue->host == QUEUE_BUFFER_SIZE) 
-    queue->host = 0;
-  queue->session_count++;
-  pthread_cond_signal(&queue->empty);
-  pthread_mutex_unlock(&queue->mutex);
-}
-
-void queue_consume(session_t *session, unsigned int session_id) {
-  pthread_mutex_lock(&queue->mutex);
-  while (queue->session_count == 0) {
-    pthread_cond_wait(&queue->empty, &queue->mutex);
-  }
-  *session = queue->buffer[queue->worker];
-  queue->worker++;
-  if (queue->worker == QUEUE_BUFFER_SIZE) 
-    queue->worker = 0;
-  queue->session_count--;
-  pthread_cond_signal(&queue->full);
-  pthread_mutex_unlock(&queue->mutex);
-  session->id = (int)session_id;
+  queue_produce_many(&session, 1);
+}
+
+void queue_produce_many(session_t *sessions[], size_t count) {
+  size_t added = 0;
+  while (added < count) {
+    if (try_enqueue(sessions[added])) {
+      added++;
+      continue;
+    }
+    // Full: the ones added so far can be taken meanwhile
+    if (added > 0) {
+      signal_change(&queue->added, &queue->consumers_waiting, added);
+      sessions += added;
+      count -= added;
+      added = 0;
+    }
+    uint32_t seen = __atomic_load_n(&queue->removed, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&queue->producers_waiting, 1, __ATOMIC_SEQ_CST);
+    if (!try_enqueue(sessions[0])) {
+      futex_wait(&queue->removed, seen);
+    } else {
+      added++;
+    }
+    __atomic_fetch_sub(&queue->producers_waiting, 1, __ATOMIC_SEQ_CST);
+  }
+  if (added > 0) {
+    signal_change(&queue->added, &queue->consumers_waiting, added);
+  }
+}
+
+session_t *queue_consume() {
+  session_t *session;
+  while ((session = try_dequeue()) == NULL) {
+    uint32_t seen = __atomic_load_n(&queue->added, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&queue->consumers_waiting, 1, __ATOMIC_SEQ_CST);
+    session = try_dequeue();
+    if (session == NULL) {
+      futex_wait(&queue->added, seen);
+    }
+    __atomic_fetch_sub(&queue->consumers_waiting, 1, __ATOMIC_SEQ_CST);
+    if (session != NULL) {
+      break;
+    }
+  }
+  signal_change(&queue->removed, &queue->producers_waiting, 1);
+  return session;
 }
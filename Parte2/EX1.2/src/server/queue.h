@@ -1,34 +1,61 @@
-#ifndef SERVER_QUEUE_H
-#define SERVER_QUEUE_H
-#include <pthread.h>
-
-#include "../common/constants.h"
-#include "parser.h"
-
-typedef struct {
-  session_t buffer[QUEUE_BUFFER_SIZE];
-  pthread_mutex_t mutex;
-  pthread_cond_t full;
-  pthread_cond_t empty;
-  int session_count;
-  int host;
-  int worker;
-} queue_t;
-
-/// @brief Initializes global producer-consumer buffer
-/// @return 0 if no errors, 1 otherwise
-int queue_init();
-
-/// @brief Destroy global producer-consumer buffer
-void queue_destroy();
-
-/// @brief adds a session to the producer-consumer buffer.
-/// @param session
-void queue_produce(session_t *session);
-
-/// @brief removes a session from the producer-consumer buffer.
-/// @param session
-/// @param session_id
-void queue_consume(session_t *session, unsigned int session_id);
-
-#endif  // SERVER_QUEUE_H
+#ifndef SERVER_QUEUE_H
+#define SERVER_QUEUE_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../common/constants.h"
+#include "parser.h"
+
+/// A slot of the queue. Its sequence tells whose turn it is: the producer of
+/// position pos while it is pos, the consumer of pos once it is pos + 1.
+typedef struct {
+  size_t sequence;
+  session_t *session;
+} queue_cell_t;
+
+/// Bounded queue of sessions, for any number of producers and consumers,
+/// without locks (Vyukov's MPMC ring). Each side only blocks to wait for the
+/// other: consumers while it is empty, producers while it is full, sleeping on
+/// a futex.
+typedef struct {
+  queue_cell_t *cells;
+  size_t mask; // capacity - 1, a power of 2
+  char cells_pad[48];
+  size_t enqueue_pos; // next position to write
+  char enqueue_pad[56];
+  size_t dequeue_pos; // next position to read
+  char dequeue_pad[56];
+  // Bumped after every session added, consumers sleep on it
+  uint32_t added;
+  uint32_t consumers_waiting;
+  // Bumped after every session removed, producers sleep on it
+  uint32_t removed;
+  uint32_t producers_waiting;
+} queue_t;
+
+/// @brief Initializes global producer-consumer buffer
+/// @param capacity Most sessions it holds, rounded up to a power of 2, 0 for
+/// QUEUE_BUFFER_SIZE.
+/// @return 0 if no errors, 1 otherwise
+int queue_init(size_t capacity);
+
+/// @brief Destroy global producer-consumer buffer
+void queue_destroy();
+
+/// @brief adds a session to the producer-consumer buffer, waiting only if it
+/// is full.
+/// @param session The session, allocated with malloc, taken by its consumer.
+void queue_produce(session_t *session);
+
+/// @brief adds sessions to the producer-consumer buffer, in order (unless
+/// other producers add theirs meanwhile), waking up as many consumers.
+/// @param sessions The sessions, as in queue_produce.
+/// @param count Number of sessions.
+void queue_produce_many(session_t *sessions[], size_t count);
+
+/// @brief removes a session from the producer-consumer buffer, sleeping while
+/// it is empty.
+/// @return The session, as given to queue_produce.
+session_t *queue_consume();
+
+#endif  // SERVER_QUEUE_H
@@ -0,0 +1,361 @@
+#include "sessions.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "../common/protocol.h"
+#include "constants.h"
+
+// Events tell the session by its slot and id, so one for a session that has
+// ended, whose slot may have been taken by a new one, is told apart.
+#define EVENT_DATA(slot, id) (((uint64_t)(uint32_t)(id) << 32) | (slot))
+#define STOP_EVENT UINT64_MAX
+#define REAP_EVENT (UINT64_MAX - 1)
+
+static struct {
+  // Held for reading to find a session to serve or notify, which is then
+  // pinned (see pin) and served with no lock, for writing to add or end one
+  pthread_rwlock_t lock;
+  session_t **slots; // NULL if free
+  size_t capacity;
+  size_t count;
+  int next_id;
+  int epoll_fd;
+  int stop[2]; // pipe written by sessions_terminate to stop the threads
+  int reap_fd; // timer to end the idle sessions, -1 if they never are
+  int (*handle)(session_t *session);
+  pthread_t threads[SESSION_THREADS];
+  size_t num_threads;
+} table = {.lock = PTHREAD_RWLOCK_INITIALIZER, .epoll_fd = -1, .reap_fd = -1};
+
+// Closes the pipes of a session, unmaps its shared memory and frees it.
+static void free_session(session_t *session) {
+  close(session->request_fd);
+  close(session->response_fd);
+  close(session->noti_fd);
+  if (session->channel != NULL) {
+    munmap(session->channel, sizeof(shm_channel_t));
+  }
+  pthread_mutex_destroy(&session->keys_lock);
+  pthread_mutex_destroy(&session->send_lock);
+  free(session->subscriptions);
+  free(session);
+}
+
+// Keeps a session from being freed, found with the table locked, while it is
+// served or notified with the table unlocked: a client that stops reading or
+// writing then holds up only its own session, not the table.
+static void pin(session_t *session) {
+  __atomic_add_fetch(&session->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Undoes a pin, freeing the session if it ended meanwhile.
+static void unpin(session_t *session) {
+  if (__atomic_sub_fetch(&session->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free_session(session);
+  }
+}
+
+// Waits for the request pipe of a session (again), its events being one shot
+// so that only one thread serves it at a time.
+static int arm(int op, session_t *session, size_t slot) {
+  struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT,
+                              .data.u64 = EVENT_DATA(slot, session->id)};
+  return epoll_ctl(table.epoll_fd, op, session->request_fd, &event);
+}
+
+// Seconds of CLOCK_MONOTONIC, for how long sessions are idle.
+static time_t now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec;
+}
+
+// Frees the slot of a session, with the table locked for writing. The
+// session itself is freed once no thread serves or notifies it; one waiting
+// for its socket is woken up to give it up.
+// @param unlink_pipes Whether to remove its pipes too, which its client would
+// otherwise, when it ends the session.
+static void remove_session(size_t slot, int unlink_pipes) {
+  session_t *session = table.slots[slot];
+  epoll_ctl(table.epoll_fd, EPOLL_CTL_DEL, session->request_fd, NULL);
+  if (session->socket) {
+    shutdown(session->request_fd, SHUT_RDWR);
+  } else if (unlink_pipes) {
+    unlink(session->request_pipe);
+    unlink(session->response_pipe);
+    unlink(session->noti_pipe);
+  }
+  table.slots[slot] = NULL;
+  table.count--;
+  unpin(session);
+}
+
+// Ends a session, unless it has ended already.
+static void end_session(size_t slot, int id) {
+  pthread_rwlock_wrlock(&table.lock);
+  session_t *session = table.slots[slot];
+  if (session != NULL && session->id == id) {
+    remove_session(slot, 0);
+  }
+  pthread_rwlock_unlock(&table.lock);
+}
+
+// Ends the sessions with no request served for SESSION_IDLE_TIMEOUT seconds,
+// whose client is most likely gone without closing its pipes (stopped, or
+// sharing them with a process still running), freeing their slots and
+// descriptors. Run when reap_fd expires, then waited for again.
+static void reap_idle() {
+  uint64_t expirations;
+  if (read(table.reap_fd, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN) {
+    fprintf(stderr, "Failed to read the idle session timer\n");
+  }
+
+  time_t oldest = now() - SESSION_IDLE_TIMEOUT;
+  pthread_rwlock_wrlock(&table.lock);
+  for (size_t i = 0; i < table.capacity; i++) {
+    session_t *session = table.slots[i];
+    if (session != NULL &&
+        __atomic_load_n(&session->last_active, __ATOMIC_RELAXED) <= oldest) {
+      printf("Session %d idle, closing it\n", session->id);
+      remove_session(i, 1);
+    }
+  }
+  pthread_rwlock_unlock(&table.lock);
+
+  struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT,
+                              .data.u64 = REAP_EVENT};
+  epoll_ctl(table.epoll_fd, EPOLL_CTL_MOD, table.reap_fd, &event);
+}
+
+// Whether a whole request header is already in a session's request pipe, so
+// it is served without waiting for another event.
+static int request_pending(const session_t *session) {
+  int size;
+  return ioctl(session->request_fd, FIONREAD, &size) == 0 &&
+         (size_t)size >= sizeof(message_header_t);
+}
+
+static void *io_thread(void *arg) {
+  (void)arg;
+  struct epoll_event events[64];
+  while (1) {
+    int ready = epoll_wait(table.epoll_fd, events, 64, -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to wait for session requests\n");
+      return NULL;
+    }
+
+    for (int i = 0; i < ready; i++) {
+      if (events[i].data.u64 == STOP_EVENT) {
+        return NULL;
+      }
+      if (events[i].data.u64 == REAP_EVENT) {
+        reap_idle();
+        continue;
+      }
+      size_t slot = (uint32_t)events[i].data.u64;
+      int id = (int)(events[i].data.u64 >> 32);
+
+      pthread_rwlock_rdlock(&table.lock);
+      session_t *session = slot < table.capacity ? table.slots[slot] : NULL;
+      if (session == NULL || session->id != id) {
+        pthread_rwlock_unlock(&table.lock);
+        continue; // ended meanwhile
+      }
+      pin(session);
+      pthread_rwlock_unlock(&table.lock);
+
+      int end;
+      do {
+        end = table.handle(session);
+      } while (!end && request_pending(session));
+      __atomic_store_n(&session->last_active, now(), __ATOMIC_RELAXED);
+      // Fails if it ended meanwhile, its descriptors being open until unpinned
+      if (!end && arm(EPOLL_CTL_MOD, session, slot) != 0) {
+        end = 1;
+      }
+      unpin(session);
+
+      if (end) {
+        end_session(slot, id);
+      }
+    }
+  }
+}
+
+int sessions_init(int (*handle)(session_t *session)) {
+  // Each session has 3 pipes (or descriptors of its socket) open
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  table.handle = handle;
+  table.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (table.epoll_fd < 0 || pipe(table.stop) != 0) {
+    fprintf(stderr, "Failed to create session event loop\n");
+    return 1;
+  }
+  struct epoll_event event = {.events = EPOLLIN, .data.u64 = STOP_EVENT};
+  if (epoll_ctl(table.epoll_fd, EPOLL_CTL_ADD, table.stop[0], &event) != 0) {
+    fprintf(stderr, "Failed to create session event loop\n");
+    return 1;
+  }
+  if (SESSION_IDLE_TIMEOUT > 0) {
+    // Checked a few times per timeout, so a session is ended at most a third
+    // of it late
+    time_t interval =
+        SESSION_IDLE_TIMEOUT / 3 > 0 ? SESSION_IDLE_TIMEOUT / 3 : 1;
+    struct itimerspec timer = {{interval, 0}, {interval, 0}};
+    event = (struct epoll_event){.events = EPOLLIN | EPOLLONESHOT,
+                                 .data.u64 = REAP_EVENT};
+    table.reap_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (table.reap_fd < 0 ||
+        timerfd_settime(table.reap_fd, 0, &timer, NULL) != 0 ||
+        epoll_ctl(table.epoll_fd, EPOLL_CTL_ADD, table.reap_fd, &event) != 0) {
+      fprintf(stderr, "Failed to create idle session timer\n");
+      return 1;
+    }
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > SESSION_THREADS) {
+    cpus = SESSION_THREADS;
+  }
+  size_t num_threads = cpus > 1 ? (size_t)cpus : 1;
+  for (table.num_threads = 0; table.num_threads < num_threads;
+       table.num_threads++) {
+    if (pthread_create(&table.threads[table.num_threads], NULL, io_thread,
+                       NULL) != 0) {
+      fprintf(stderr, "Failed to create session thread\n");
+      sessions_terminate();
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int sessions_add(session_t *session) {
+  pthread_rwlock_wrlock(&table.lock);
+  if (table.count == table.capacity) {
+    size_t capacity = table.capacity > 0 ? 2 * table.capacity : 64;
+    session_t **slots = realloc(table.slots, capacity * sizeof(session_t *));
+    if (slots == NULL) {
+      pthread_rwlock_unlock(&table.lock);
+      return 1;
+    }
+    for (size_t i = table.capacity; i < capacity; i++) {
+      slots[i] = NULL;
+    }
+    table.slots = slots;
+    table.capacity = capacity;
+  }
+  size_t slot = 0;
+  while (table.slots[slot] != NULL) {
+    slot++;
+  }
+
+  session->id = table.next_id;
+  table.next_id = table.next_id < INT32_MAX ? table.next_id + 1 : 0;
+  pthread_mutex_init(&session->keys_lock, NULL);
+  pthread_mutex_init(&session->send_lock, NULL);
+  if (arm(EPOLL_CTL_ADD, session, slot) != 0) {
+    pthread_mutex_destroy(&session->keys_lock);
+    pthread_mutex_destroy(&session->send_lock);
+    pthread_rwlock_unlock(&table.lock);
+    return 1;
+  }
+  session->last_active = now();
+  session->refs = 1;
+  table.slots[slot] = session;
+  table.count++;
+  pthread_rwlock_unlock(&table.lock);
+  return 0;
+}
+
+void sessions_for_each(int (*fn)(session_t *session, void *arg), void *arg) {
+  // Pinned a few at a time, then called with the table unlocked
+  session_t *sessions[64];
+  size_t slots[64];
+  size_t next = 0;
+  while (1) {
+    size_t num = 0;
+    pthread_rwlock_rdlock(&table.lock);
+    for (; next < table.capacity && num < 64; next++) {
+      if (table.slots[next] != NULL) {
+        sessions[num] = table.slots[next];
+        slots[num++] = next;
+        pin(table.slots[next]);
+      }
+    }
+    pthread_rwlock_unlock(&table.lock);
+    if (num == 0) {
+      return;
+    }
+
+    for (size_t i = 0; i < num; i++) {
+      int id = sessions[i]->id;
+      int end = fn(sessions[i], arg);
+      unpin(sessions[i]);
+      if (end) {
+        end_session(slots[i], id);
+      }
+    }
+  }
+}
+
+void sessions_close_all() {
+  pthread_rwlock_wrlock(&table.lock);
+  for (size_t i = 0; i < table.capacity; i++) {
+    if (table.slots[i] != NULL) {
+      printf("Removing session %d\n", table.slots[i]->id);
+      remove_session(i, 1);
+    }
+  }
+  pthread_rwlock_unlock(&table.lock);
+}
+
+void sessions_terminate() {
+  if (table.num_threads > 0 && write(table.stop[1], "", 1) == 1) {
+    for (size_t i = 0; i < table.num_threads; i++) {
+      pthread_join(table.threads[i], NULL);
+    }
+  }
+  table.num_threads = 0;
+
+  pthread_rwlock_wrlock(&table.lock);
+  for (size_t i = 0; i < table.capacity; i++) {
+    if (table.slots[i] != NULL) {
+      remove_session(i, 0);
+    }
+  }
+  free(table.slots);
+  table.slots = NULL;
+  table.capacity = table.count = 0;
+  pthread_rwlock_unlock(&table.lock);
+
+  close(table.stop[0]);
+  close(table.stop[1]);
+  if (table.reap_fd >= 0) {
+    close(table.reap_fd);
+    table.reap_fd = -1;
+  }
+  close(table.epoll_fd);
+  table.epoll_fd = -1;
+}
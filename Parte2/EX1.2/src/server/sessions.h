@@ -0,0 +1,38 @@
+#ifndef SERVER_SESSIONS_H
+#define SERVER_SESSIONS_H
+
+#include <stddef.h>
+
+#include "parser.h"
+
+/// @brief Starts the threads serving the requests of the sessions: one per
+/// online CPU, at most SESSION_THREADS. They wait on the request pipes of
+/// every session at once (epoll), so any number of sessions can be connected.
+/// With SESSION_IDLE_TIMEOUT, they also end the sessions with no request for
+/// that long, their clients being most likely gone.
+/// @param handle Serves the next request of a session, called when its request
+/// pipe has data or was closed, never for two requests of a session at once.
+/// Returns 0 to keep serving the session, 1 to end it.
+/// @return 0 if no errors, 1 otherwise
+int sessions_init(int (*handle)(session_t *session));
+
+/// @brief Adds a session, whose pipes are open, and serves it from then on.
+/// @param session The session, allocated with malloc, freed when it ends.
+/// @return 0 if no errors, 1 otherwise (the session is then not taken)
+int sessions_add(session_t *session);
+
+/// @brief Calls a function for every session, with no lock held: it may wait
+/// on the session, which is not freed meanwhile, but its requests are still
+/// served, so what both use must be locked (keys_lock). Sessions added or
+/// ended meanwhile may be left out.
+/// @param fn Function to call. Returns 0 to keep the session, 1 to end it.
+/// @param arg Argument for the function.
+void sessions_for_each(int (*fn)(session_t *session, void *arg), void *arg);
+
+/// @brief Ends every session, removing their pipes.
+void sessions_close_all();
+
+/// @brief Stops the threads started by sessions_init and ends every session.
+void sessions_terminate();
+
+#endif  // SERVER_SESSIONS_H
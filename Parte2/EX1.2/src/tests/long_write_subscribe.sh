@@ -0,0 +1,56 @@
+#!/bin/bash
+# Runs a job whose WRITEs have more pairs than MAX_WRITE_SIZE, so they are
+# applied in chunks, while clients subscribe and unsubscribe one of their
+# keys. Fails if the server stops answering them, as it did when a chunked
+# WRITE notified the sessions with the table still locked.
+# usage: src/tests/long_write_subscribe.sh, from the directory of the Makefile
+KVS=${KVS:-src/server/kvs}
+CLIENT=${CLIENT:-src/client/client}
+PAIRS=1000  # per WRITE, in 4 chunks
+WRITES=200
+CLIENTS=4
+ROUNDS=2000 # SUBSCRIBE and UNSUBSCRIBE of each client
+
+DIR=$(mktemp -d)
+NAME=lws_$$
+mkdir "$DIR/jobs"
+# The job waits for the clients to connect
+awk -v pairs=$PAIRS -v writes=$WRITES 'BEGIN {
+  print "WRITE [(k1,v0)]"
+  print "WAIT 100"
+  for (w = 1; w <= writes; w++) {
+    line = "WRITE ["
+    for (p = 1; p <= pairs; p++) line = line "(k" p ",v" w ")"
+    print line "]"
+  }
+}' > "$DIR/jobs/long.job"
+
+"$KVS" "$DIR/jobs" 1 1 "$NAME" > "$DIR/server.out" 2>&1 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; rm -rf "$DIR" /tmp/$NAME /tmp/$NAME.sock' EXIT
+sleep 0.2
+
+pids=()
+for c in $(seq 1 $CLIENTS); do
+  {
+    for r in $(seq 1 $ROUNDS); do
+      printf 'SUBSCRIBE [k1]\nUNSUBSCRIBE [k1]\n'
+    done
+    printf 'DISCONNECT\n'
+  } | timeout 30 "$CLIENT" lws_$$_$c /tmp/$NAME > "$DIR/client$c.out" 2>&1 &
+  pids+=($!)
+done
+
+status=0
+for c in $(seq 1 $CLIENTS); do
+  if ! wait ${pids[$((c - 1))]}; then
+    echo "FAIL: client $c got no answer (server hung)"
+    status=1
+  fi
+done
+if [ $status -eq 0 ] && ! kill -0 $SERVER 2>/dev/null; then
+  echo "FAIL: server exited"
+  status=1
+fi
+[ $status -eq 0 ] && echo "OK"
+exit $status
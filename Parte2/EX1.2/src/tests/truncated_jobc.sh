@@ -0,0 +1,49 @@
+#!/bin/bash
+# Runs a compiled job cut short inside a WRITE split in chunks, next to a job
+# that changes the table after it. Fails if the second job never runs, as
+# when the table was left locked (ATOMIC_COMMANDS) by the chunks applied.
+# usage: src/tests/truncated_jobc.sh, from the directory of the Makefile
+KVS=${KVS:-src/server/kvs}
+KVSC=${KVSC:-src/server/kvsc}
+PAIRS=1000 # of the WRITE, in 4 chunks
+
+DIR=$(mktemp -d)
+NAME=tjc_$$
+mkdir "$DIR/jobs"
+awk -v pairs=$PAIRS 'BEGIN {
+  line = "WRITE ["
+  for (p = 1; p <= pairs; p++) line = line "(k" p ",v)"
+  print line "]"
+  print "SHOW"
+}' > "$DIR/jobs/cut.job"
+# Runs once the other job has locked the table
+printf 'WAIT 300\nWRITE [(x,1)]\nREAD [x]\n' > "$DIR/jobs/other.job"
+
+"$KVSC" "$DIR/jobs/cut.job" || exit 1
+# Keeps the header, the first chunk and half of the second
+python3 - "$DIR/jobs/cut.jobc" <<'EOF'
+import struct, sys
+path = sys.argv[1]
+data = open(path, 'rb').read()
+first = 32 + 6 + struct.unpack('<I', data[32:36])[0]
+second = 6 + struct.unpack('<I', data[first:first + 4])[0]
+open(path, 'r+b').truncate(first + second // 2)
+EOF
+
+"$KVS" "$DIR/jobs" 2 1 "$NAME" > "$DIR/server.out" 2>&1 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; rm -rf "$DIR" /tmp/$NAME /tmp/$NAME.sock' EXIT
+
+for i in $(seq 1 50); do
+  grep -q '(x,1)' "$DIR/jobs/other.out" 2>/dev/null && break
+  sleep 0.1
+done
+if ! grep -q '(x,1)' "$DIR/jobs/other.out" 2>/dev/null; then
+  echo "FAIL: the other job never ran (table left locked)"
+  exit 1
+fi
+if ! grep -q 'Compiled job is corrupted' "$DIR/server.out"; then
+  echo "FAIL: the cut job was not found corrupted"
+  exit 1
+fi
+echo "OK"